@@ -0,0 +1,81 @@
+/*
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ */
+
+#ifndef KERNEL_APIC_H
+#define KERNEL_APIC_H
+
+#include <types.h>
+
+/* Model specific registers */
+#define APIC_MSR_BASE			0x01B
+#define APIC_MSR_TSC_DEADLINE		0x6E0
+
+#define APIC_BASE_ENABLE		0x00000800
+#define APIC_BASE_ADDRESS		0xFFFFF000
+
+/* Registers, as offsets from the base address */
+#define APIC_REGISTER_ID		0x020
+#define APIC_REGISTER_VERSION		0x030
+#define APIC_REGISTER_TPR		0x080	/* Task priority */
+#define APIC_REGISTER_EOI		0x0B0
+#define APIC_REGISTER_SPURIOUS		0x0F0
+#define APIC_REGISTER_ICR_LOW		0x300	/* Interrupt command, writing it sends */
+#define APIC_REGISTER_ICR_HIGH		0x310	/* Destination */
+#define APIC_REGISTER_LVT_TIMER		0x320
+#define APIC_REGISTER_LVT_LINT0		0x350
+#define APIC_REGISTER_LVT_LINT1		0x360
+#define APIC_REGISTER_LVT_ERROR		0x370
+#define APIC_REGISTER_TIMER_INITIAL	0x380
+#define APIC_REGISTER_TIMER_CURRENT	0x390
+#define APIC_REGISTER_TIMER_DIVIDE	0x3E0
+
+#define APIC_SPURIOUS_ENABLE		0x100
+
+/* Interrupt command */
+#define APIC_ICR_FIXED			0x00000
+#define APIC_ICR_INIT			0x00500
+#define APIC_ICR_STARTUP		0x00600
+#define APIC_ICR_PENDING		0x01000	/* Delivery status */
+#define APIC_ICR_LEVEL_ASSERT		0x04000
+#define APIC_ICR_TRIGGER_LEVEL		0x08000	/* Edge triggered if clear */
+
+/* Local vector table entries */
+#define APIC_LVT_DELIVERY_NMI		0x00400
+#define APIC_LVT_DELIVERY_EXTINT	0x00700
+#define APIC_LVT_MASKED			0x10000
+
+/* Exclusive */
+#define APIC_LVT_TIMER_ONESHOT		0x00000
+#define APIC_LVT_TIMER_PERIODIC		0x20000
+#define APIC_LVT_TIMER_TSC_DEADLINE	0x40000
+
+#define APIC_TIMER_DIVIDE_16		0x3
+
+/* Interrupt vectors, above the ones of the 8259 */
+#define APIC_VECTOR_TIMER		0x30
+#define APIC_VECTOR_RESCHEDULE		0x31
+#define APIC_VECTOR_TLB			0x32
+#define APIC_VECTOR_SPURIOUS		0xFF
+
+#define APIC_CALIBRATE_MS		10	/* PIT interval the timer is measured against */
+
+// Mapped registers, 0 if the local APIC is not used
+extern volatile uint32_t *apic_registers;
+
+// Longest one-shot of the timer, in ticks
+extern unsigned int apic_timer_max;
+
+err_t apic_init(void);
+void apic_init_cpu(void);
+void apic_ipi(unsigned int apic_id, uint32_t command);
+err_t apic_timer_init(void);
+void apic_timer_periodic(void);
+void apic_timer_tick(void);
+void apic_timer_oneshot(unsigned int ticks);
+unsigned int apic_timer_elapsed(void);
+void apic_timer_stop(void);
+
+#endif /* !defined KERNEL_APIC_H */
@@ -11,6 +11,7 @@
 
 /* From Misc/ll_bit.asm */
 unsigned int bit_find_set(unsigned int value);
+unsigned int bit_find_last_set(unsigned int value);
 unsigned int bit_find_reset(unsigned int value);
 unsigned int bit_set(unsigned int value, unsigned int bit_index);
 unsigned int bit_reset(unsigned int value, unsigned int bit_index);
@@ -18,8 +18,16 @@
 #define CPU_PAGE_FLAG_PRESENT	0x001
 #define CPU_PAGE_FLAG_WRITABLE	0x002
 #define CPU_PAGE_FLAG_USER	0x004
+#define CPU_PAGE_FLAG_WRITETHROUGH	0x008
+#define CPU_PAGE_FLAG_NOCACHE	0x010	/* Memory mapped device registers */
+#define CPU_PAGE_FLAG_LARGE	0x080	/* 4MB page, in a page directory entry */
 #define CPU_PAGE_FLAG_GLOBAL	0x100
 
+/* Page fault error code */
+#define CPU_PAGE_FAULT_PRESENT	0x001	/* Protection violation, the page was present */
+#define CPU_PAGE_FAULT_WRITE	0x002
+#define CPU_PAGE_FAULT_USER	0x004
+
 #define CPU_PAGE_SIZE		4096
 #define CPU_PAGE_SHIFT		12
 
@@ -28,6 +36,11 @@
 
 
 
+/* EFLAGS bits */
+#define CPU_FLAG_INTERRUPT	0x200
+
+
+
 /*************************
  * Processor information *
  *************************/
@@ -35,9 +48,15 @@
 enum cpu_vendor { vendorIntel = 0, vendorUMC, vendorAMD, vendorCyrix, vendorNexGen, vendorCentaur,
 			vendorRise, vendorSiS, vendorTransmeta, vendorNSC, vendorUnknown = -1 };
 
+#define CPU_MAX				8	/* Processors with their own data */
+
 /* Processor capabilities */
 #define CPU_CAPABILITY_GLOBALPAGES	0x00000001
 #define CPU_CAPABILITY_TIMESTAMPCOUNTER	0x00000002
+#define CPU_CAPABILITY_PSE		0x00000004
+#define CPU_CAPABILITY_MSR		0x00000008	/* RDMSR and WRMSR */
+#define CPU_CAPABILITY_APIC		0x00000010	/* Local APIC */
+#define CPU_CAPABILITY_TSCDEADLINE	0x00000020	/* Local APIC timer in TSC-deadline mode */
 
 struct {
 	enum cpu_vendor 	vendor;
@@ -184,19 +203,67 @@ union dt_entry {
 #define CPU_GDT_INDEX_USER_SS		5
 #define CPU_GDT_INDEX_TSS_DOUBLE_FAULT	6
 #define CPU_GDT_INDEX_TSS_KERNEL	7
+#define CPU_GDT_INDEX_CPU		8	/* Its limit is the index of the processor, see cpu_current */
+#define CPU_GDT_INDEX_TSS_PAGE_FAULT	9
+#define CPU_GDT_ENTRIES			10
 
 struct idt_info {
 	uint16_t length;
 	uint32_t addr;
 } __attribute__((packed));
 
+/* Same layout, for LGDT */
+struct gdt_info {
+	uint16_t length;
+	uint32_t addr;
+} __attribute__((packed));
+
+
+
+/**********************
+ * Per-processor data *
+ **********************/
+
+/*
+ * Every processor has its own GDT, which differs from the boot one (x86.asm)
+ * in its TSSes and in the limit of the CPU_GDT_INDEX_CPU descriptor.
+ */
+struct cpu_data {
+	union dt_entry		gdt[CPU_GDT_ENTRIES];
+	struct gdt_info		gdt_info;
+
+	struct tss		tss;			/* Ring 0 stack, and the state saved on a page or double fault */
+	struct tss		double_fault_tss;
+	struct tss		page_fault_tss;
+
+	unsigned int		apic_id;
+	volatile unsigned int	online;			/* Started, and taking TLB flush requests */
+};
+
+extern struct cpu_data cpu_data[CPU_MAX];
+
 /* From x86.asm */
+extern void cpu_pse_enable(void);
+extern void cpu_pge_enable(void);
 extern void cpu_mmu_invalidate(uint32_t start, size_t length);
-extern void cpu_mmu_switch(uint32_t new_pgdir);
+extern void cpu_mmu_flush(void);
+extern void cpu_mmu_flush_global(void);
+extern uint32_t cpu_mmu_fault_address(void);
 
 extern uint32_t cpu_flags_get(void);
+extern uint32_t cpu_interrupt_save(void);
+extern void cpu_interrupt_restore(uint32_t eflags);
+extern void cpu_halt(void);
+extern unsigned int cpu_current(void);
+extern void cpu_lgdt(struct gdt_info *info);
+
+extern uint64_t cpu_rdtsc(void);
+extern uint64_t cpu_msr_read(uint32_t msr);
+extern void cpu_msr_write(uint32_t msr, uint64_t value);
 
 err_t cpu_init(void);
+void cpu_gdt_init(unsigned int cpu);
+void cpu_mmu_switch(uint32_t page_directory);
 void delay(unsigned int ms);
 
 
@@ -12,7 +12,27 @@
 #define DMA_PAGE_SIZE			65536
 #define DMA_NEXT_BOUNDARY(start)	(((start) & ~(DMA_PAGE_SIZE - 1)) + DMA_PAGE_SIZE)
 
+#define DMA_MAP_SEGMENTS		8		/* Segments of a single map */
+#define DMA_BOUNCE_SIZE			16384		/* Biggest bounce buffer */
+
+struct dma_segment {
+	void		*buffer;			/* Caller memory */
+	uint32_t	physical;			/* What the controller is given */
+	size_t		length;
+	void		*bounce;			/* Bounce buffer, 0 if the transfer is straight to buffer */
+};
+
+struct dma_map {
+	unsigned	read_flag;			/* Device to memory */
+	size_t		length;				/* Bytes mapped, maybe less than asked */
+	unsigned int	count;
+	struct dma_segment segment[DMA_MAP_SEGMENTS];
+};
+
 err_t dma_transfer(unsigned channel, void *dest, size_t len, unsigned read_flag);
+err_t dma_transfer_physical(unsigned channel, uint32_t addr, size_t len, unsigned read_flag);
+err_t dma_map(struct dma_map *map, void *buffer, size_t len, size_t unit, unsigned read_flag);
+void dma_unmap(struct dma_map *map);
 err_t dma_init(void);
 
 #endif /* !defined KERNEL_DMA_H */
@@ -20,7 +20,13 @@ extern void interrupt_enable(void);
 extern void interrupt_disable(void);
 
 err_t interrupt_init(void);
-err_t interrupt_init_doublefault(void);
+err_t interrupt_init_doublefault(unsigned int cpu);
+err_t interrupt_init_pagefault(unsigned int cpu);
+void interrupt_init_tasks(void);
+void interrupt_init_cpu(void);
+
+int interrupt_lock(void);
+void interrupt_unlock(void);
 
 err_t interrupt_irq_register(uint8_t number, void (*isr)(void));
 err_t interrupt_irq_enable(uint8_t number);
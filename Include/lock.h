@@ -0,0 +1,25 @@
+/*
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ */
+
+#ifndef KERNEL_LOCK_H
+#define KERNEL_LOCK_H
+
+#include <types.h>
+
+/*
+ * Spin locks. They only keep other processors out: code which can also run
+ * in an interrupt handler must disable interrupts before taking the lock.
+ */
+typedef volatile unsigned int spinlock_t;
+
+#define SPINLOCK_INITIALIZER	0
+
+/* From Misc/ll_lock.asm */
+void lock_acquire(spinlock_t *lock);
+void lock_release(spinlock_t *lock);
+unsigned int lock_try(spinlock_t *lock);
+
+#endif /* !defined KERNEL_LOCK_H */
@@ -12,37 +12,307 @@
 #define MM_AREA_KERNEL_START		0x00000000
 #define MM_AREA_KERNEL_END		0x50000000
 
+#define MM_AREA_IDENTITY_END		0x00800000	/* Low memory and kernel, identity mapped */
+
+/*
+ * Every page directory maps itself at 0x02000000, so the page tables of the
+ * current space are seen there as a linear array of page table entries.
+ */
+#define MM_AREA_PAGE_TABLES		0x02000000
+#define MM_PAGE_DIRECTORY		(MM_AREA_PAGE_TABLES + ((MM_AREA_PAGE_TABLES >> 22) << 12))
+#define MM_PAGE_TABLE_ENTRY(page)	(((uint32_t *)MM_AREA_PAGE_TABLES)[page])
+
+#define MM_AREA_WINDOW_START		0x02400000	/* Temporary mappings (kmap slots) */
+
+#define MM_AREA_HEAP_START		0x02800000
+#define MM_AREA_HEAP_END		0x12800000
+
+#define MM_AREA_STACKS_START		0x12800000	/* Thread stacks, page tables allocated at boot */
+#define MM_AREA_STACKS_END		0x16800000
+
+#define MM_AREA_DEVICES_START		0x16800000	/* Memory mapped devices and DMA buffers */
+#define MM_AREA_DEVICES_END		MM_AREA_KERNEL_END
+
 #define MM_AREA_USER_START		MM_AREA_KERNEL_END
 #define MM_AREA_USER_CODEDATA_START	0xC0000000
 #define MM_AREA_USER_CODEDATA_END	0xE0000000
 #define MM_AREA_USER_END		0xFFFFF000
 
+#define MM_USER_STACK_PAGES		16	/* Initial user stack, which grows down on demand */
+
 /* init.c */
 err_t mm_init(void);
 
+/* buddy.c */
+#define MM_BUDDY_ORDERS			11	/* Blocks from 4KB (order 0) to 4MB (order 10) */
+
+struct mm_buddy {
+	uint32_t	base;				/* First frame covered by the bitmaps */
+	uint32_t	frames;				/* Number of frames covered */
+	unsigned int	free_frames;			/* Free frames in all the orders */
+
+	uint32_t	*bitmap[MM_BUDDY_ORDERS];	/* One bit per block, set when free */
+	unsigned int	free_blocks[MM_BUDDY_ORDERS];	/* Free blocks of each order */
+	unsigned int	hint[MM_BUDDY_ORDERS];		/* No free block before this bitmap word */
+};
+
+uint32_t *mm_buddy_init(struct mm_buddy *buddy, uint32_t start_frame, uint32_t end_frame, uint32_t *metadata);
+size_t mm_buddy_metadata_size(uint32_t start_frame, uint32_t end_frame);
+err_t mm_buddy_allocate(struct mm_buddy *buddy, unsigned int order, uint32_t *frame);
+void mm_buddy_free(struct mm_buddy *buddy, uint32_t frame, unsigned int order);
+void mm_buddy_add(struct mm_buddy *buddy, uint32_t frame, uint32_t count);
+
 /* ppage.c */
+#define MM_ZONE_DMA			0	/* ISA DMA reachable memory, below 16MB */
+#define MM_ZONE_NORMAL			1
+#define MM_ZONES			2
+
+#define MM_ZONE_DMA_END			0x01000000
+
 err_t mm_ppage_init(uint32_t *kernel_end);
 err_t mm_ppage_pop(uint32_t *ptr, size_t count);
 void mm_ppage_push(uint32_t *ptr, size_t count);
+err_t mm_ppage_allocate(unsigned int order, uint32_t *ptr);
+err_t mm_ppage_allocate_zone(unsigned int zone, unsigned int order, uint32_t *ptr);
+void mm_ppage_free(uint32_t ptr, unsigned int order);
 unsigned int mm_ppage_get_free(void);
 unsigned int mm_ppage_get_total(void);
+unsigned int mm_ppage_get_zone_free(unsigned int zone);
+unsigned int mm_ppage_get_zone_total(unsigned int zone);
+err_t mm_ppage_pop_zeroed(uint32_t *ptr);
+void mm_ppage_zero_refill(void);
+
+/*
+ * Page frame database, one 16-bit entry per physical frame. What a frame is
+ * used for (page table, DMA...) is told by its owner, so only the flags the
+ * allocator needs are kept.
+ */
+#define MM_PAGE_FLAG_ZEROED		0x1	/* Cleared when allocated */
+#define MM_PAGE_FLAG_PINNED		0x2	/* Never given back to the allocator (kernel image, DMA) */
+
+#define MM_OWNER_FREE			0
+#define MM_OWNER_KERNEL			1
+#define MM_OWNER_HEAP			2
+#define MM_OWNER_PAGE_TABLE		3
+#define MM_OWNER_USER			4
+#define MM_OWNER_DMA			5
+#define MM_OWNERS			6		/* Up to 8 */
+
+#define MM_PAGE_COUNT_MAX		2047
+
+struct mm_page {
+	uint16_t	count : 11;			/* Mappings and other references to the frame */
+	uint16_t	owner : 3;			/* MM_OWNER_*, for accounting */
+	uint16_t	flags : 2;			/* MM_PAGE_FLAG_* */
+};
+
+struct mm_page *mm_page_get(uint32_t ptr);
+void mm_page_set_owner(uint32_t ptr, unsigned int owner);
+void mm_page_set_flags(uint32_t ptr, unsigned int flags);
+err_t mm_page_reference(uint32_t ptr);
+void mm_page_release(uint32_t ptr);
+void mm_page_release_array(uint32_t *ptr, size_t count);
+unsigned int mm_page_get_owner_count(unsigned int owner);
 
 /* heap.c */
+#define MM_HEAP_TRIM_THRESHOLD		(256 * 1024)	/* Free bytes at the top of the heap before it is shrunk */
+
+void mm_heap_init(size_t size);
+size_t mm_heap_get_size(void);
+size_t mm_heap_get_high_water(void);
+size_t mm_heap_get_trimmed(void);
 void* mm_heap_allocate(size_t bytes);
 void* mm_heap_allocate_aligned(size_t alignment, size_t bytes);
 void* mm_heap_reallocate(void* oldmem, size_t bytes);
 void mm_heap_free(void* mem);
 
+/* What dlmalloc's mallinfo reports, plus the blocks cached by the magazines */
+struct mm_heap_info {
+	size_t		arena;				/* Bytes taken from the heap area */
+	size_t		max_arena;			/* Biggest the arena has been */
+	size_t		used;				/* Bytes in chunks in use, the magazine ones included */
+	size_t		free;				/* Bytes in free chunks, the top one included */
+	size_t		top;				/* Free bytes at the top, which trimming can give back */
+	unsigned int	free_chunks;			/* Free chunks in the bins, and the top one */
+	unsigned int	fast_chunks;			/* Freed chunks in the fast bins */
+	size_t		fast_free;			/* Bytes in the fast bins */
+	unsigned int	magazine_blocks;		/* Free blocks held by the per-processor magazines */
+	size_t		magazine_free;			/* Bytes in the magazines */
+};
+
+void mm_heap_get_info(struct mm_heap_info *info);
+
+/* profile.c, only with the HEAP_PROFILE build option */
+#define MM_HEAP_PROFILE_RATE		16	/* Default allocations per sample */
+#define MM_HEAP_PROFILE_SITES		64	/* Call sites tracked */
+#define MM_HEAP_PROFILE_BLOCKS		1024	/* Sampled blocks tracked at once, a power of two */
+#define MM_HEAP_PROFILE_BUCKETS		8	/* Size histogram: up to 16 bytes, 64, 256, ..., 64K, more */
+
+struct mm_heap_site {
+	uint32_t	caller;				/* Return address of the heap call, 0 when the table was full */
+	size_t		live_bytes;			/* Sampled bytes still allocated */
+	unsigned int	live_blocks;
+	unsigned int	allocations;			/* Sampled allocations ever made */
+	unsigned int	histogram[MM_HEAP_PROFILE_BUCKETS];
+};
+
+#ifdef MM_HEAP_PROFILE
+
+extern unsigned int mm_heap_profile_rate;
+
+void mm_heap_profile_allocate(void *block, size_t bytes, void *caller);
+void mm_heap_profile_free(void *block);
+unsigned int mm_heap_profile_get(struct mm_heap_site *sites, unsigned int count);
+void mm_heap_profile_reset(void);
+void mm_heap_profile_dump(void);
+
+#endif
+
+/* slab.c */
+#define MM_SLAB_LINE			32	/* Cache line size, the step of slab colouring */
+#define MM_SLAB_MIN_OBJECTS		8	/* Objects a slab should hold at least */
+#define MM_SLAB_MAX_PAGES		16	/* Biggest slab */
+#define MM_SLAB_EMPTY_MAX		2	/* Empty slabs kept by a cache */
+
+struct mm_slab;
+
+struct mm_slab_cache {
+	unsigned char	*name;
+	size_t		size;				/* Object size, with its alignment */
+	size_t		slab_size;			/* Bytes of a slab, a power of two pages */
+	unsigned int	objects;			/* Objects in a slab */
+	void		(*constructor)(void *object);
+
+	unsigned int	colour;				/* Offset of the objects in the next slab */
+	unsigned int	colour_max;			/* Space left over in a slab */
+
+	struct mm_slab	*partial;			/* Slabs with both used and free objects */
+	struct mm_slab	*full;
+	struct mm_slab	*empty;
+	unsigned int	empty_count;
+
+	unsigned int	allocated;			/* Objects in use */
+	unsigned int	slabs;
+};
+
+err_t mm_slab_cache_init(struct mm_slab_cache *cache, unsigned char *name, size_t size, void (*constructor)(void *object));
+void *mm_slab_allocate(struct mm_slab_cache *cache);
+void mm_slab_free(struct mm_slab_cache *cache, void *object);
+void mm_slab_shrink(struct mm_slab_cache *cache);
+
+/* tlb.c */
+#define MM_TLB_FLUSH_THRESHOLD		32	/* Default pages above which the whole TLB is flushed */
+
+struct mm_tlb_gather {
+	uint32_t	start;				/* First page to invalidate */
+	uint32_t	end;				/* Page after the last one */
+	unsigned int	global;				/* Kernel pages, which may be global, are included */
+};
+
+extern unsigned int mm_tlb_flush_threshold;
+
+void mm_tlb_gather_init(struct mm_tlb_gather *tlb);
+void mm_tlb_gather_add(struct mm_tlb_gather *tlb, uint32_t start, uint32_t length);
+void mm_tlb_gather_flush(struct mm_tlb_gather *tlb);
+void mm_tlb_flush_local(struct mm_tlb_gather *tlb);
+
 /* map.c */
+#define MM_PAGE_RESERVED		0x200	/* Not present entry backed on the first access. The owner is in the frame bits */
+#define MM_PAGE_COW			0x400	/* Read-only shared page, copied on the first write */
+
+#define MM_PAGE_TABLE_CACHE		16	/* Cleared page tables kept for reuse */
+
+err_t mm_page_table_allocate(uint32_t *frame);
+void mm_page_table_free(uint32_t frame);
+err_t mm_map_owned(uint32_t start, uint32_t length, unsigned flags, unsigned int owner);
 err_t mm_map(uint32_t start, uint32_t length, unsigned flags);
 err_t mm_map_physical(uint32_t virtual, uint32_t physical, uint32_t length, unsigned flags);
+err_t mm_map_physical_gather(struct mm_tlb_gather *tlb, uint32_t virtual, uint32_t physical, uint32_t length, unsigned flags);
 void mm_unmap(uint32_t start, uint32_t length);
+void mm_unmap_gather(struct mm_tlb_gather *tlb, uint32_t start, uint32_t length);
 void mm_unmap_physical(uint32_t start, uint32_t length);
+void mm_unmap_physical_gather(struct mm_tlb_gather *tlb, uint32_t start, uint32_t length);
+err_t mm_reserve(uint32_t start, uint32_t length, unsigned flags, unsigned int owner);
+err_t mm_map_commit(uint32_t start, uint32_t length);
+err_t mm_map_fault(uint32_t address, uint32_t error_code);
+void mm_protect(uint32_t start, uint32_t length, unsigned flags);
 err_t mm_map_check(uint32_t page);
-err_t mm_map_page_directory(uint32_t page_dir);
+err_t mm_map_translate(uint32_t virtual, uint32_t *physical);
+void mm_map_clear_frame(uint32_t frame);
+
+/* Temporary mapping slots, per processor */
+#define MM_KMAP_ZERO			0	/* Page clearing */
+#define MM_KMAP_COPY			1	/* Copy on write target */
+#define MM_KMAP_DIRECTORY		2	/* Page directory of another space */
+#define MM_KMAP_TABLE			3	/* Page table of another space */
+#define MM_KMAP_SLOTS			8
+
+void *mm_kmap(unsigned int slot, uint32_t frame);
+
+/* vma.c */
+#define MM_VMA_READ			0x1	/* Protection */
+#define MM_VMA_WRITE			0x2
+#define MM_VMA_EXECUTE			0x4
+
+#define MM_VMA_ANONYMOUS		0	/* Backing kinds */
+#define MM_VMA_FILE			1
+#define MM_VMA_SHARED			2
+#define MM_VMA_STACK			3
+#define MM_VMA_KINDS			4
+
+#define MM_VMA_GROWS_DOWN		0x1	/* Flags */
+#define MM_VMA_GROWS_UP			0x2
+
+#define MM_VMA_GROW_PAGES		256	/* Maximum size of a growable area */
+
+struct mm_vma {
+	uint32_t	start;				/* First page */
+	uint32_t	end;				/* Page after the last one */
+	unsigned int	protection;			/* MM_VMA_READ, _WRITE, _EXECUTE */
+	unsigned int	kind;				/* Backing kind */
+	unsigned int	flags;				/* Grow direction */
+	uint32_t	limit;				/* Farthest page a growable area can reach */
+
+	void		*object;			/* File or shared memory backing the area */
+	uint32_t	offset;				/* Offset of the area start in the object */
+
+	struct mm_vma	*left;
+	struct mm_vma	*right;
+	int		height;
+};
+
+struct mm_vma *mm_vma_find(struct mm_vma *root, uint32_t page);
+err_t mm_vma_map(struct mm_vma **root, uint32_t start, uint32_t length, unsigned int protection, unsigned int kind,
+	unsigned int flags, struct mm_vma **vma);
+err_t mm_vma_unmap(struct mm_vma **root, uint32_t start, uint32_t length);
+err_t mm_vma_protect(struct mm_vma **root, uint32_t start, uint32_t length, unsigned int protection);
+err_t mm_vma_fault(struct mm_vma **root, uint32_t address, uint32_t error_code);
+err_t mm_vma_clone(struct mm_vma *root, struct mm_vma **copy);
+void mm_vma_destroy(struct mm_vma **root);
+
+/* space.c */
+err_t mm_space_create(uint32_t *page_directory);
+err_t mm_space_clone(uint32_t *page_directory);
+void mm_space_destroy(uint32_t page_directory);
+
+/* vmalloc.c */
+#define MM_VM_PURGE_PAGES		1024	/* Freed pages waiting before the TLB is flushed and they are reused */
+
+err_t mm_vm_init(void);
+err_t mm_vmalloc(size_t bytes, void **address);
+err_t mm_vreserve(size_t bytes, void **address);
+err_t mm_vstack(size_t bytes, void **address);
+err_t mm_ioremap(uint32_t physical, size_t bytes, unsigned flags, void **address);
+void mm_vfree(void *address);
+void mm_vm_purge(void);
 
 /* dma.c */
+#define MM_DMA_UNIT			512	/* Allocation unit of DMA buffers, a sector */
+#define MM_DMA_GROW_ORDER		4	/* Blocks taken from the DMA zone, a DMA page */
+
 err_t mm_dma_init(void);
 err_t mm_dma_allocate(size_t len, void **buffer);
+err_t mm_dma_allocate_aligned(size_t len, size_t alignment, void **buffer);
+void mm_dma_free(void *buffer);
 
 #endif /* !defined KERNEL_MM_H */
@@ -9,6 +9,7 @@
 
 #include <cpu.h>
 #include <types.h>
+#include <timer.h>
 
 /* Sleep objects */
 
@@ -25,23 +26,30 @@ typedef struct {
 #define PROCESS_MAX_PID			65535
 #define PROCESS_THREAD_STACK_MIN	CPU_PAGE_SIZE	// Minimum stack size
 #define PROCESS_THREAD_STACK_DEFAULT	CPU_PAGE_SIZE
-#define PROCESS_THREAD_STACK_MAX	0xFFFFFFFF	// Maximum stack size. XXX - Set this
+#define PROCESS_THREAD_STACK_MAX	0x00100000	// Maximum stack size. Only the pages touched are backed
 
 enum processPriority { priorityIdle, priorityLow, priorityNormal, priorityHigh };
+#define PROCESS_PRIORITIES		(priorityHigh + 1)
 enum processStatus   { statusReady, statusSleeping, statusZombie };
 
 struct thread {
 	uint32_t		esp;
-	uint32_t		kernel_esp;
+	uint32_t		stack;		/* Bottom of the stack range */
 
 	enum processPriority	priority;
 	enum processStatus	status;
 	sleep_object_t		*cur_sleep_object;
+	struct timer		timer;		/* Wakes the thread up from process_thread_sleep_time */
 
 	struct process		*parent;
+	unsigned int		cpu;		/* Processor whose ready queues it goes to */
 
 	struct thread		*previous;
 	struct thread		*next;
+
+	/* Ready queue of the priority, while the thread is ready but not running */
+	struct thread		*run_previous;
+	struct thread		*run_next;
 };
 
 struct process {
@@ -50,6 +58,7 @@ struct process {
 	unsigned int		thread_count;	/* Threads count */
 
 	uint32_t		page_directory;	/* Page directory physical address */
+	struct mm_vma		*vmas;		/* User memory areas */
 
 	struct thread		*thread_list;
 
@@ -59,30 +68,50 @@ struct process {
 
 struct process	*process_list;
 
-struct process 	*current_process;
-struct thread	*current_thread;
+/* Running thread and process of every processor, and its idle thread */
+struct thread	*process_cpu_thread[CPU_MAX];
+struct process	*process_cpu_process[CPU_MAX];
+struct thread	*process_cpu_idle[CPU_MAX];
+
+/* From x86.asm */
+extern struct thread *process_current_thread(void);
+extern struct process *process_current_process(void);
+
+/* Of the processor running the caller */
+#define current_thread		(process_current_thread())
+#define current_process		(process_current_process())
 
 unsigned int total_threads, total_processes;
 
+/* Object caches for the process and thread structures, in init.c */
+extern struct mm_slab_cache process_cache, thread_cache;
+
 unsigned int *free_pid_bitmap;
 size_t free_pid_bitmap_size;
 
 err_t process_init(void);
+void process_init_cpu(void);
+err_t process_init_tss(unsigned int cpu);
 
 err_t process_create(unsigned char *name, unsigned char *path);
+err_t process_clone(unsigned char *name, uint32_t eip, struct process **child);
+err_t process_terminate(struct process *process);
 
 err_t process_thread_create(struct process *parent, enum processPriority priority, uint32_t eip, uint32_t stack_size);
 err_t process_thread_terminate(struct thread *thread);
+void process_thread_destroy(struct thread *thread);
 
 err_t process_thread_sleep_object(sleep_object_t *obj);
 err_t process_thread_sleep_time(unsigned int ms);
 err_t process_thread_wakeup_object(sleep_object_t *obj);
 
-void process_schedule_disable(void);
-void process_schedule_enable(void);
+void process_schedule_enqueue(struct thread *thread);
+void process_schedule_dequeue(struct thread *thread);
+unsigned int process_schedule_ready(void);
 
 // Threads
 void process_loader(void);
 void process_thread_slayer(void);
+void process_thread_idle(void);
 
 #endif /* !defined KERNEL_PROCESS_H */
@@ -0,0 +1,109 @@
+/*
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ */
+
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+#include <types.h>
+#include <mm.h>
+
+/* ACPI */
+#define SMP_ACPI_RSDP_SIGNATURE		"RSD PTR "
+#define SMP_ACPI_MADT_SIGNATURE		"APIC"
+#define SMP_ACPI_MADT_LAPIC		0	/* Entry of a processor, with its local APIC */
+#define SMP_ACPI_LAPIC_ENABLED		0x1
+
+/* Intel MultiProcessor Specification */
+#define SMP_MP_FLOATING_SIGNATURE	"_MP_"
+#define SMP_MP_TABLE_SIGNATURE		"PCMP"
+#define SMP_MP_ENTRY_PROCESSOR		0	/* 20 bytes long, the other entries 8 */
+#define SMP_MP_PROCESSOR_ENABLED	0x1
+
+/* BIOS data area */
+#define SMP_BIOS_EBDA_SEGMENT		0x40E	/* Word, segment of the extended BIOS data area */
+#define SMP_BIOS_BASE_MEMORY		0x413	/* Word, KB of base memory */
+
+#define SMP_START_TIMEOUT		100	/* Milliseconds a processor is given to start */
+
+struct smp_acpi_rsdp {
+	uint8_t		signature[8];
+	uint8_t		checksum;
+	uint8_t		oem[6];
+	uint8_t		revision;
+	uint32_t	rsdt;
+} __attribute__((packed));
+
+struct smp_acpi_header {
+	uint8_t		signature[4];
+	uint32_t	length;
+	uint8_t		revision;
+	uint8_t		checksum;
+	uint8_t		oem[6];
+	uint8_t		oem_table[8];
+	uint32_t	oem_revision;
+	uint32_t	creator;
+	uint32_t	creator_revision;
+} __attribute__((packed));
+
+struct smp_acpi_madt {
+	struct smp_acpi_header	header;
+	uint32_t		apic_address;
+	uint32_t		flags;
+} __attribute__((packed));
+
+struct smp_acpi_madt_lapic {
+	uint8_t		type;
+	uint8_t		length;
+	uint8_t		processor;
+	uint8_t		apic_id;
+	uint32_t	flags;
+} __attribute__((packed));
+
+struct smp_mp_floating {
+	uint8_t		signature[4];
+	uint32_t	table;		/* Physical address of the configuration table, 0 if there is none */
+	uint8_t		length;		/* In 16 byte units */
+	uint8_t		revision;
+	uint8_t		checksum;
+	uint8_t		features[5];
+} __attribute__((packed));
+
+struct smp_mp_table {
+	uint8_t		signature[4];
+	uint16_t	length;
+	uint8_t		revision;
+	uint8_t		checksum;
+	uint8_t		oem[8];
+	uint8_t		product[12];
+	uint32_t	oem_table;
+	uint16_t	oem_table_length;
+	uint16_t	entries;
+	uint32_t	apic_address;
+	uint16_t	extended_length;
+	uint8_t		extended_checksum;
+	uint8_t		reserved;
+} __attribute__((packed));
+
+struct smp_mp_processor {
+	uint8_t		type;
+	uint8_t		apic_id;
+	uint8_t		apic_version;
+	uint8_t		flags;
+	uint32_t	signature;
+	uint32_t	features;
+	uint32_t	reserved[2];
+} __attribute__((packed));
+
+// Processors running, the boot one included
+extern unsigned int smp_cpus;
+
+err_t smp_init(void);
+void smp_start(void);
+void smp_reschedule(unsigned int cpu);
+void smp_tlb_shootdown(struct mm_tlb_gather *tlb);
+void smp_tlb_poll(void);
+
+#endif /* !defined KERNEL_SMP_H */
@@ -13,14 +13,49 @@
 #define TIMER_8253_PORT_COUNTER0	0x40
 #define TIMER_8253_PORT_COUNTER1	0x41
 #define TIMER_8253_PORT_COUNTER2	0x42
+#define TIMER_8253_PORT_GATE		0x61	/* Counter 2 gate (bit 0) and output (bit 5) */
+
+#define TIMER_8253_MODE_ONESHOT		0	/* Interrupt on terminal count */
+#define TIMER_8253_MODE_PERIODIC	3	/* Square wave generator */
 
 /* Frequencies (in Hz) */
+#define TIMER_8253_HZ		1193181
 #define TIMER_GRANULARITY_HZ	1000
 #define TIMER_GRANULARITY_MS	(1000 / TIMER_GRANULARITY_HZ)
 
-// System ticks, incremented in x86.asm - _irq0_handler
+#define TIMER_8253_COUNT	(TIMER_8253_HZ / TIMER_GRANULARITY_HZ)	/* Counts of a tick */
+#define TIMER_ONESHOT_MAX	(0xFFFF / TIMER_8253_COUNT)		/* Longest one-shot of the PIT, in ticks */
+#define TIMER_IDLE_MAX		(60 * TIMER_GRANULARITY_HZ)		/* Longest idle one-shot, in ticks */
+
+// System ticks, counted in timer.c - timer_tick
 volatile unsigned int _ticks;
 
+extern unsigned int timer_dynamic_tick;
+extern unsigned int timer_apic_enable;
+
+/*
+ * Timer wheel. A timer calls its function, from the timer interrupt and with
+ * interrupts disabled, once the tick it expires at is reached.
+ */
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)		/* Slots of a level */
+#define TIMER_WHEEL_LEVELS	4				/* 2^24 ticks ahead, later timers wait in the last level */
+
+struct timer {
+	unsigned int	expires;			/* Tick */
+	void		(*function)(void *data);
+	void		*data;
+
+	struct timer	**slot;				/* Wheel slot, 0 if the timer is not pending */
+	struct timer	*previous;
+	struct timer	*next;
+};
+
 err_t timer_init(void);
+void timer_setup(struct timer *timer, void (*function)(void *data), void *data);
+void timer_add(struct timer *timer, unsigned int ticks);
+int timer_cancel(struct timer *timer);
+void timer_tick(void);
+void timer_idle(void);
 
 #endif /* !defined KERNEL_TIMER_H */
@@ -0,0 +1,190 @@
+/*
+ * Memory manager/buddy.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Binary buddy allocator for physical frames.
+ *
+ * Every order has a bitmap with one bit per naturally aligned block of that
+ * order: a set bit means the block is free and is not part of a bigger free
+ * block. Blocks are aligned to their size in physical memory, so the frame
+ * numbers handed out can be used for 4MB pages or DMA transfers directly.
+ *
+ * The bitmaps are stored in the identity mapped area after the kernel, since
+ * free frames themselves are not mapped anywhere and cannot hold list links.
+ */
+
+#include <mm.h>
+#include <types.h>
+#include <memory.h>
+#include <bit.h>
+
+#define block_test(map, index)	((map)[(index) >> 5] & (1 << ((index) & 31)))
+#define block_set(map, index)	((map)[(index) >> 5] |= (1 << ((index) & 31)))
+#define block_reset(map, index)	((map)[(index) >> 5] &= ~(1 << ((index) & 31)))
+
+/* Number of 32-bit words needed to hold the bitmap of the given order */
+#define bitmap_words(frames, order)	((((frames) >> (order)) + 31) >> 5)
+
+static inline void buddy_insert(struct mm_buddy *buddy, unsigned int order, uint32_t index)
+{
+	block_set(buddy->bitmap[order], index);
+	buddy->free_blocks[order]++;
+
+	if ((index >> 5) < buddy->hint[order])
+		buddy->hint[order] = index >> 5;
+}
+
+static inline void buddy_remove(struct mm_buddy *buddy, unsigned int order, uint32_t index)
+{
+	block_reset(buddy->bitmap[order], index);
+	buddy->free_blocks[order]--;
+}
+
+/* Find (and remove) the first free block of the given order. The caller must make sure there is one */
+static uint32_t buddy_take(struct mm_buddy *buddy, unsigned int order)
+{
+uint32_t *map = buddy->bitmap[order];
+unsigned int word;
+uint32_t index;
+
+	word = buddy->hint[order];
+	while (!map[word])
+		word++;
+
+	buddy->hint[order] = word;
+
+	index = (word << 5) + bit_find_set(map[word]);
+	buddy_remove(buddy, order, index);
+
+	return index;
+}
+
+/**************************
+ * Allocation and freeing *
+ **************************/
+
+err_t mm_buddy_allocate(struct mm_buddy *buddy, unsigned int order, uint32_t *frame)
+{
+unsigned int cur_order;
+uint32_t index;
+
+	if (order >= MM_BUDDY_ORDERS)
+		return ERROR_INVALID;
+
+	/* Find the smallest order with a free block that fits */
+	for (cur_order = order; cur_order < MM_BUDDY_ORDERS; cur_order++)
+		if (buddy->free_blocks[cur_order])
+			break;
+
+	if (cur_order == MM_BUDDY_ORDERS)
+		return ERROR_NO_MEMORY;
+
+	index = buddy_take(buddy, cur_order);
+
+	/* Split it down to the requested size, giving back the upper halves */
+	while (cur_order > order) {
+		cur_order--;
+		index <<= 1;
+		buddy_insert(buddy, cur_order, index | 1);
+	}
+
+	buddy->free_frames -= 1 << order;
+	*frame = buddy->base + (index << order);
+
+	return 0;
+}
+
+void mm_buddy_free(struct mm_buddy *buddy, uint32_t frame, unsigned int order)
+{
+uint32_t index;
+
+	buddy->free_frames += 1 << order;
+	index = (frame - buddy->base) >> order;
+
+	/* Coalesce with the buddy block as long as it is free */
+	while (order < MM_BUDDY_ORDERS - 1) {
+		if (!block_test(buddy->bitmap[order], index ^ 1))
+			break;
+
+		buddy_remove(buddy, order, index ^ 1);
+		index >>= 1;
+		order++;
+	}
+
+	buddy_insert(buddy, order, index);
+}
+
+/*
+ * Give a whole range of frames to the allocator. The range is split in the
+ * biggest naturally aligned blocks that fit, so it costs O(log n) instead of
+ * one free per frame.
+ */
+void mm_buddy_add(struct mm_buddy *buddy, uint32_t frame, uint32_t count)
+{
+unsigned int order;
+
+	while (count) {
+		order = MM_BUDDY_ORDERS - 1;
+		while ((frame & ((1 << order) - 1)) || ((1 << order) > count))
+			order--;
+
+		mm_buddy_free(buddy, frame, order);
+
+		frame += 1 << order;
+		count -= 1 << order;
+	}
+}
+
+/******************
+ * Initialization *
+ ******************/
+
+/*
+ * Set up an empty allocator for the frames between start_frame and end_frame (excluded).
+ * The bitmaps are placed at metadata and the first word after them is returned.
+ */
+uint32_t *mm_buddy_init(struct mm_buddy *buddy, uint32_t start_frame, uint32_t end_frame, uint32_t *metadata)
+{
+unsigned int order, words;
+
+	/* Align the base to the biggest block, so every block is naturally aligned in physical memory too */
+	buddy->base = start_frame & ~((1 << (MM_BUDDY_ORDERS - 1)) - 1);
+	buddy->frames = end_frame - buddy->base;
+	buddy->free_frames = 0;
+
+	for (order = 0; order < MM_BUDDY_ORDERS; order++) {
+		words = bitmap_words(buddy->frames, order);
+
+		buddy->bitmap[order] = metadata;
+		buddy->free_blocks[order] = 0;
+		buddy->hint[order] = 0;
+
+		memory_clear(metadata, words * sizeof(uint32_t));
+		metadata += words;
+	}
+
+	return metadata;
+}
+
+/* Size in bytes of the metadata needed by mm_buddy_init */
+size_t mm_buddy_metadata_size(uint32_t start_frame, uint32_t end_frame)
+{
+unsigned int order;
+uint32_t frames;
+size_t size = 0;
+
+	frames = end_frame - (start_frame & ~((1 << (MM_BUDDY_ORDERS - 1)) - 1));
+
+	for (order = 0; order < MM_BUDDY_ORDERS; order++)
+		size += bitmap_words(frames, order) * sizeof(uint32_t);
+
+	return size;
+}
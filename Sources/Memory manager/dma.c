@@ -9,95 +9,235 @@
  * Initial release: 2005-04-04
  */
 
+/*
+ * DMA buffer allocator.
+ *
+ * The ISA DMA controller only reaches the first 16MB, and a transfer cannot
+ * cross a DMA_PAGE_SIZE boundary. The pool is made of regions, each within a
+ * single DMA page: the free memory below 1MB, split at the boundaries, and
+ * blocks taken from the DMA zone when that runs out. A buffer never spans two
+ * regions, so it never crosses a boundary.
+ *
+ * Every region has a bitmap of MM_DMA_UNIT byte units in use, and a second
+ * one marking the last unit of every buffer, so freeing needs no length.
+ * Alignment is of the physical address, which is what devices see.
+ */
+
 #include <mm.h>
 #include <multiboot.h>
 #include <memory.h>
 #include <dma.h>
+#include <cpu.h>
+#include <kernel.h>
+#include <interrupt.h>
 
-static struct dma_memory_entry {
-	unsigned int 		start;
-	unsigned int 		length;
+#define DMA_REGION_UNITS	(DMA_PAGE_SIZE / MM_DMA_UNIT)
+#define DMA_REGION_WORDS	(DMA_REGION_UNITS / 32)
+#define DMA_REGIONS		(MM_ZONE_DMA_END / DMA_PAGE_SIZE)
 
-	struct dma_memory_entry	*prev;
-	struct dma_memory_entry	*next;
-} *dma_memory_pool;
+#define dma_bit_test(map, i)	((map)[(i) >> 5] & (1 << ((i) & 31)))
+#define dma_bit_set(map, i)	((map)[(i) >> 5] |= (1 << ((i) & 31)))
+#define dma_bit_reset(map, i)	((map)[(i) >> 5] &= ~(1 << ((i) & 31)))
 
-unsigned int dma_entries = 0;
+static struct dma_region {
+	uint32_t	start;				/* Virtual address of the first unit */
+	uint32_t	physical;
+	unsigned int	units;
+	unsigned int	free;				/* Units not in use */
 
-/*
- * Entry management
- */
-static err_t mm_dma_entry_add(unsigned int start, size_t length)
+	uint32_t	used[DMA_REGION_WORDS];
+	uint32_t	last[DMA_REGION_WORDS];		/* Last unit of every buffer */
+} dma_region[DMA_REGIONS];
+
+static unsigned int dma_regions;
+
+static err_t mm_dma_region_add(uint32_t start, uint32_t physical, size_t length)
 {
-struct dma_memory_entry *entry;
+struct dma_region *region;
 
-	entry = (struct dma_memory_entry *)mm_heap_allocate(sizeof(struct dma_memory_entry));
-	if (!entry)
+	if (dma_regions == DMA_REGIONS)
 		return ERROR_NO_MEMORY;
 
-	entry->start = start;
-	entry->length = length;
-	entry->prev = 0;
-	entry->next = dma_memory_pool;
-	if (dma_memory_pool)
-		dma_memory_pool->prev = entry;
+	region = &dma_region[dma_regions++];
+	memory_clear(region, sizeof(struct dma_region));
 
-	dma_memory_pool = entry;
+	region->start = start;
+	region->physical = physical;
+	region->units = region->free = length / MM_DMA_UNIT;
 
 	return 0;
 }
 
-static err_t mm_dma_entry_remove(struct dma_memory_entry *ptr)
+/*
+ * Find units free units in a region, the first one at a physical address
+ * multiple of alignment. Returns the first unit, or -1.
+ */
+static int mm_dma_region_find(struct dma_region *region, unsigned int units, size_t alignment)
 {
-struct dma_memory_entry *prev, *next;
+unsigned int first, step, i;
 
-	prev = ptr->prev;
-	next = ptr->next;
+	if (region->free < units)
+		return -1;
 
-	// Restore old settings
-	if (prev)
-		prev->next = next;
-	if (next)
-		next->prev = prev;
+	/* Regions start on a unit, so smaller alignments are always there */
+	step = max(alignment / MM_DMA_UNIT, 1);
+	first = (((region->physical + alignment - 1) & ~(alignment - 1)) - region->physical) / MM_DMA_UNIT;
 
-	// Free
-	mm_heap_free(ptr);	
-	
-	return 0;
+	while (first + units <= region->units) {
+		for (i = first; i < first + units; i++)
+			if (dma_bit_test(region->used, i))
+				break;
+
+		if (i == first + units)
+			return first;
+
+		/* Go on from the next aligned unit after the used one */
+		first += ((i - first) / step + 1) * step;
+	}
+
+	return -1;
+}
+
+/*
+ * Grow the pool with a block from the DMA zone, a whole DMA page if possible.
+ * Buddy blocks are naturally aligned, so a block up to DMA_PAGE_SIZE never
+ * crosses a DMA page boundary, and is aligned to its size.
+ */
+static err_t mm_dma_grow(size_t len)
+{
+unsigned int order = 0;
+uint32_t physical, i;
+void *buffer;
+err_t ret;
+
+	while ((CPU_PAGE_SIZE << order) < len)
+		order++;
+
+	if (!mm_ppage_allocate_zone(MM_ZONE_DMA, max(order, MM_DMA_GROW_ORDER), &physical))
+		order = max(order, MM_DMA_GROW_ORDER);
+	else
+		return_on_failure(mm_ppage_allocate_zone(MM_ZONE_DMA, order, &physical));
+
+	ret = mm_ioremap(physical, CPU_PAGE_SIZE << order, CPU_PAGE_FLAG_WRITABLE, &buffer);
+	if (ret) {
+		mm_ppage_free(physical, order);
+		return ret;
+	}
+
+	/* The regions are never given back, so buffers can be had later on */
+	for (i = 0; i < (1 << order); i++) {
+		mm_page_set_owner(physical + (i << 12), MM_OWNER_DMA);
+		mm_page_set_flags(physical + (i << 12), MM_PAGE_FLAG_PINNED);
+	}
+
+	return mm_dma_region_add((uint32_t)buffer, physical, CPU_PAGE_SIZE << order);
+}
+
+static err_t mm_dma_pool_allocate(unsigned int units, size_t alignment, void **buffer)
+{
+struct dma_region *region;
+unsigned int r, i;
+int first;
+
+	for (r = 0; r < dma_regions; r++) {
+		region = &dma_region[r];
+
+		first = mm_dma_region_find(region, units, alignment);
+		if (first < 0)
+			continue;
+
+		for (i = first; i < first + units; i++)
+			dma_bit_set(region->used, i);
+		dma_bit_set(region->last, first + units - 1);
+		region->free -= units;
+
+		*buffer = (void *)(region->start + first * MM_DMA_UNIT);
+
+		return 0;
+	}
+
+	return ERROR_NO_MEMORY;
 }
 
 /*************************
  * DMA memory allocation *
  *************************/
 
+/*
+ * Allocate a buffer for device transfers. It is below 16MB, does not cross a
+ * DMA page boundary, and its physical address is a multiple of alignment,
+ * which must be a power of two up to DMA_PAGE_SIZE.
+ */
+err_t mm_dma_allocate_aligned(size_t len, size_t alignment, void **buffer)
+{
+unsigned int units;
+uint32_t eflags;
+err_t ret;
+
+	*buffer = 0;
+
+	if (!len || (len > DMA_PAGE_SIZE) || !alignment || (alignment & (alignment - 1)) || (alignment > DMA_PAGE_SIZE))
+		return ERROR_INVALID;
+
+	units = (len + MM_DMA_UNIT - 1) / MM_DMA_UNIT;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	ret = mm_dma_pool_allocate(units, alignment, buffer);
+	if (ret) {
+		/* The pool is exhausted, so take more from the DMA zone */
+		ret = mm_dma_grow(max(len, alignment));
+		if (!ret)
+			ret = mm_dma_pool_allocate(units, alignment, buffer);
+	}
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return ret;
+}
+
 err_t mm_dma_allocate(size_t len, void **buffer)
 {
-struct dma_memory_entry *ptr = dma_memory_pool;
-
-	while (ptr) {
-		// Check length
-		if (ptr->length < len)
-			goto next;
-
-		*buffer = (void *)ptr->start;
-
-		// Are we allocating the entire entry?
-		if (len == ptr->length) {
-			// Free this entry
-			mm_dma_entry_remove(ptr);
-		} else {
-			// Resize this entry
-			ptr->start += len;
+	return mm_dma_allocate_aligned(len, MM_DMA_UNIT, buffer);
+}
+
+void mm_dma_free(void *buffer)
+{
+struct dma_region *region = 0;
+unsigned int r, i;
+uint32_t eflags;
+
+	if (!buffer)
+		return;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	for (r = 0; r < dma_regions; r++)
+		if (((uint32_t)buffer >= dma_region[r].start) && ((uint32_t)buffer < dma_region[r].start + dma_region[r].units * MM_DMA_UNIT)) {
+			region = &dma_region[r];
+			break;
 		}
 
-		return 0;
+	i = region ? ((uint32_t)buffer - region->start) / MM_DMA_UNIT : 0;
+	if (!region || ((uint32_t)buffer & (MM_DMA_UNIT - 1)) || !dma_bit_test(region->used, i) ||
+		(i && dma_bit_test(region->used, i - 1) && !dma_bit_test(region->last, i - 1)))
+		kernel_bug("Freeing a DMA buffer which was not allocated");
 
-	next:
-		ptr = ptr->next;
+	for (;; i++) {
+		dma_bit_reset(region->used, i);
+		region->free++;
+
+		if (dma_bit_test(region->last, i))
+			break;
 	}
 
-	*buffer = 0;
-	return ERROR_NO_MEMORY;
+	dma_bit_reset(region->last, i);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
 }
 
 /*
@@ -106,31 +246,29 @@ struct dma_memory_entry *ptr = dma_memory_pool;
 err_t mm_dma_init(void)
 {
 unsigned int i, mmap_entries;
-err_t ret;
-unsigned int start, len, entry_size;
+uint32_t start, end, length;
 
 	mmap_entries = _multiboot->mmap_length / sizeof(struct e820_map_entry);
 
 	// Scan through every e820 map entry and take memory below 1MB
 	for (i = 0; i < mmap_entries; i++) {
 		#define entry 		_multiboot->mmap_entry[i]
-		#define ROUND_LEN(len)	((len) & (DMA_PAGE_SIZE - 1))
 
-		if (entry.type != typeAvailable || entry.base_addr > 0x100000)
+		if ((entry.type != typeAvailable) || (entry.base_addr >= 0x100000))
 			continue;
 
-		// Add an entry for each area not spanning a page boundary
-		start = entry.base_addr;
-		len = entry.length;
-		while (len) {
-			entry_size = len > DMA_PAGE_SIZE ? DMA_PAGE_SIZE : len;
-			mm_dma_entry_add(start, entry_size);
-			start += entry_size;
-			len -= entry_size;
+		/* The first page holds the real mode interrupt table, and its buffers would look null */
+		start = max((uint32_t)entry.base_addr, CPU_PAGE_SIZE);
+		start = (start + MM_DMA_UNIT - 1) & ~(MM_DMA_UNIT - 1);
+		end = (uint32_t)min(entry.base_addr + entry.length, 0x100000ULL) & ~(MM_DMA_UNIT - 1);
+
+		// Add a region for each piece not spanning a page boundary
+		while (start < end) {
+			length = min(DMA_NEXT_BOUNDARY(start), end) - start;
+			return_on_failure(mm_dma_region_add(start, start, length));
+			start += length;
 		}
-		
 	}
-		
 
 	return 0;
 }
@@ -15,31 +15,72 @@
 #include <cpu.h>
 #include <memory.h>
 #include <mm.h>
+#include <lock.h>
+#include <interrupt.h>
 
-static void *heap_end = (void *)0x00800000;
+static void *heap_end = (void *)MM_AREA_HEAP_START;
+static void *heap_limit = (void *)MM_AREA_HEAP_START;
 
+/* Statistics */
+static size_t heap_high_water;		/* Biggest size the heap reached */
+static size_t heap_trimmed;		/* Bytes given back by trimming */
+
+/*
+ * Grow or shrink the heap, for dlmalloc. Pages are only reserved when the
+ * heap grows and backed when touched. dlmalloc shrinks the heap when more
+ * than MM_HEAP_TRIM_THRESHOLD bytes are free at its top, and those frames
+ * go back to the physical allocator.
+ */
 static void *mm_heap_adjust(ssize_t delta)
 {
 void *ret = heap_end;
-
-	delta = size_in_pages(delta);
+uint32_t pages;
 
 	if (delta > 0) {
-		if (mm_map((uint32_t)heap_end >> 12, delta, CPU_PAGE_FLAG_WRITABLE))
+		pages = size_in_pages(delta);
+		if (pages > ((uint32_t)heap_limit - (uint32_t)heap_end) >> 12)
 			return (void *)0;
 
-		heap_end += delta << 12;
+		/* The pages are backed when touched */
+		if (mm_reserve((uint32_t)heap_end >> 12, pages, CPU_PAGE_FLAG_WRITABLE, MM_OWNER_HEAP))
+			return (void *)0;
+
+		heap_end += pages << 12;
+		heap_high_water = max(heap_high_water, (uint32_t)heap_end - MM_AREA_HEAP_START);
 	} else if (delta < 0) {
-		delta = -delta;
+		/* dlmalloc only gives back whole pages */
+		pages = (uint32_t)-delta >> 12;
 
-		mm_unmap((uint32_t)heap_end >> 12 - delta, delta);
+		mm_unmap(((uint32_t)heap_end >> 12) - pages, pages);
 
-		heap_end -= delta << 12;
+		heap_end -= pages << 12;
+		heap_trimmed += pages << 12;
 	}
 
 	return ret;
 }
 
+/* Set how much of the heap area can be used. The page tables must be there already */
+void mm_heap_init(size_t size)
+{
+	heap_limit = (void *)(MM_AREA_HEAP_START + size);
+}
+
+size_t mm_heap_get_size(void)
+{
+	return (uint32_t)heap_end - MM_AREA_HEAP_START;
+}
+
+size_t mm_heap_get_high_water(void)
+{
+	return heap_high_water;
+}
+
+size_t mm_heap_get_trimmed(void)
+{
+	return heap_trimmed;
+}
+
 
 
 /*
@@ -539,7 +580,7 @@ struct mallinfo {
 
 #define M_TRIM_THRESHOLD       -1
 
-#define DEFAULT_TRIM_THRESHOLD (256 * 1024)
+#define DEFAULT_TRIM_THRESHOLD MM_HEAP_TRIM_THRESHOLD
 
 /*
   M_TOP_PAD is the amount of extra `padding' space to allocate or
@@ -645,57 +686,92 @@ static void   private_mm_heap_free(void*);
 static void*  private_mm_heap_reallocate(void*, size_t);
 static void*  private_mm_heap_allocate_aligned(size_t, size_t);
 
+static void*  heap_magazine_allocate(int);
+static int    heap_magazine_free(void*);
+static int    heap_class(size_t);
+
 /*
-  MALLOC_PREACTION and MALLOC_POSTACTION should be
-  defined to return 0 on success, and nonzero on failure.
-  The return value of MALLOC_POSTACTION is currently ignored
-  in wrapper functions since there is no reasonable default
-  action to take on failure.
+  The arena is shared by every processor, so it is only entered with
+  heap_lock held and interrupts disabled. Small blocks of the common sizes
+  go through the per-processor magazines instead (see below).
 */
 
-static int malloc_mutex;
-#define MALLOC_PREACTION  (0)
-#define MALLOC_POSTACTION (0)
+static spinlock_t heap_lock = SPINLOCK_INITIALIZER;
 
+static uint32_t heap_lock_acquire(void) {
+  uint32_t eflags = cpu_flags_get();
+  interrupt_disable();
+  lock_acquire(&heap_lock);
+  return eflags;
+}
+
+static void heap_lock_release(uint32_t eflags) {
+  lock_release(&heap_lock);
+  if (eflags & CPU_FLAG_INTERRUPT)
+    interrupt_enable();
+}
+
+/*
+  With the HEAP_PROFILE build option every block is reported to the
+  profiler (profile.c), charged to the caller of these wrappers.
+*/
+
+#ifdef MM_HEAP_PROFILE
+#define heap_profile_allocate(m, bytes) \
+  mm_heap_profile_allocate(m, bytes, __builtin_return_address(0))
+#define heap_profile_free(m)            mm_heap_profile_free(m)
+#else
+#define heap_profile_allocate(m, bytes)
+#define heap_profile_free(m)
+#endif
 
 void* mm_heap_allocate(size_t bytes) {
   void* m;
-  if (MALLOC_PREACTION != 0) {
-    return 0;
-  }
-  m = private_mm_heap_allocate(bytes);
-  if (MALLOC_POSTACTION != 0) {
+  uint32_t eflags;
+  int class = heap_class(bytes);
+  if (class >= 0)
+    m = heap_magazine_allocate(class);
+  else {
+    eflags = heap_lock_acquire();
+    m = private_mm_heap_allocate(bytes);
+    heap_lock_release(eflags);
   }
+  heap_profile_allocate(m, bytes);
   return m;
 }
 
 void mm_heap_free(void* m) {
-  if (MALLOC_PREACTION != 0) {
+  uint32_t eflags;
+  if (!m)
     return;
-  }
+  heap_profile_free(m);
+  if (heap_magazine_free(m))
+    return;
+  eflags = heap_lock_acquire();
   private_mm_heap_free(m);
-  if (MALLOC_POSTACTION != 0) {
-  }
+  heap_lock_release(eflags);
 }
 
 void* mm_heap_reallocate(void* m, size_t bytes) {
-  if (MALLOC_PREACTION != 0) {
-    return 0;
-  }
-  m = private_mm_heap_reallocate(m, bytes);
-  if (MALLOC_POSTACTION != 0) {
+  void* new;
+  uint32_t eflags;
+  eflags = heap_lock_acquire();
+  new = private_mm_heap_reallocate(m, bytes);
+  heap_lock_release(eflags);
+  if (new) {
+    heap_profile_free(m);
+    heap_profile_allocate(new, bytes);
   }
-  return m;
+  return new;
 }
 
 void* mm_heap_allocate_aligned(size_t alignment, size_t bytes) {
   void* m;
-  if (MALLOC_PREACTION != 0) {
-    return 0;
-  }
+  uint32_t eflags;
+  eflags = heap_lock_acquire();
   m = private_mm_heap_allocate_aligned(alignment, bytes);
-  if (MALLOC_POSTACTION != 0) {
-  }
+  heap_lock_release(eflags);
+  heap_profile_allocate(m, bytes);
   return m;
 }
 
@@ -2829,6 +2905,184 @@ void* private_mm_heap_allocate_aligned(size_t alignment, size_t bytes)
 }
 
 
+/*
+  ------------------------ Per-processor magazines ------------------------
+*/
+
+/*
+  Every processor keeps a magazine of free blocks for each small size
+  class. Allocating and freeing such a block only disables interrupts on
+  the local processor. When a magazine is empty or full, HEAP_MAGAZINE_BATCH
+  blocks are moved from or to the arena at once, under a single lock.
+
+  A class holds chunks of one exact size, so any freed chunk of that size
+  can go to the magazine, wherever it was allocated.
+*/
+
+#define HEAP_CLASSES         5
+#define HEAP_MAGAZINE_SIZE   32
+#define HEAP_MAGAZINE_BATCH  16
+
+static const size_t heap_class_size[HEAP_CLASSES] = {16, 32, 64, 128, 256};
+
+static struct heap_magazine {
+  unsigned int count;
+  void*        block[HEAP_MAGAZINE_SIZE];
+} heap_magazine[CPU_MAX][HEAP_CLASSES];
+
+/* Smallest class holding a request, or -1 */
+static int heap_class(size_t bytes)
+{
+int class;
+
+	for (class = 0; class < HEAP_CLASSES; class++)
+		if (bytes <= heap_class_size[class])
+			return class;
+
+	return -1;
+}
+
+static void *heap_magazine_allocate(int class)
+{
+struct heap_magazine *magazine;
+uint32_t eflags;
+void *mem = 0;
+
+	/* The magazines of this processor are its own, so the interrupt lock is not needed */
+	eflags = cpu_interrupt_save();
+
+	magazine = &heap_magazine[cpu_current()][class];
+	if (magazine->count)
+		mem = magazine->block[--magazine->count];
+
+	cpu_interrupt_restore(eflags);
+
+	if (mem)
+		return mem;
+
+	/* Growing the heap may take the interrupt lock, which comes before heap_lock */
+	eflags = heap_lock_acquire();
+
+	magazine = &heap_magazine[cpu_current()][class];
+
+	while (magazine->count < HEAP_MAGAZINE_BATCH) {
+		mem = private_mm_heap_allocate(heap_class_size[class]);
+		if (!mem)
+			break;
+
+		magazine->block[magazine->count++] = mem;
+	}
+
+	mem = magazine->count ? magazine->block[--magazine->count] : 0;
+
+	heap_lock_release(eflags);
+
+	return mem;
+}
+
+/* Returns 1 if the block went to a magazine */
+static int heap_magazine_free(void *mem)
+{
+struct heap_magazine *magazine;
+CHUNK_SIZE_T size;
+uint32_t eflags;
+int class;
+
+	size = chunksize(mem2chunk(mem));
+
+	for (class = 0; class < HEAP_CLASSES; class++)
+		if (size == request2size(heap_class_size[class]))
+			break;
+
+	if (class == HEAP_CLASSES)
+		return 0;
+
+	eflags = cpu_interrupt_save();
+
+	magazine = &heap_magazine[cpu_current()][class];
+	if (magazine->count < HEAP_MAGAZINE_SIZE) {
+		magazine->block[magazine->count++] = mem;
+		cpu_interrupt_restore(eflags);
+		return 1;
+	}
+
+	cpu_interrupt_restore(eflags);
+
+	eflags = heap_lock_acquire();
+
+	magazine = &heap_magazine[cpu_current()][class];
+
+	if (magazine->count == HEAP_MAGAZINE_SIZE)
+		while (magazine->count > HEAP_MAGAZINE_SIZE - HEAP_MAGAZINE_BATCH)
+			private_mm_heap_free(magazine->block[--magazine->count]);
+
+	magazine->block[magazine->count++] = mem;
+
+	heap_lock_release(eflags);
+
+	return 1;
+}
+
+/*
+  ------------------------------ mallinfo ------------------------------
+*/
+
+/*
+  Walk the bins, like dlmalloc's mallinfo. The magazines of the other
+  processors are read without their owners stopping, so their share is
+  only a snapshot.
+*/
+
+void mm_heap_get_info(struct mm_heap_info *info)
+{
+mstate av = get_malloc_state();
+mchunkptr p;
+mbinptr b;
+uint32_t eflags;
+unsigned int i, class;
+
+	memory_clear(info, sizeof(struct mm_heap_info));
+
+	for (i = 0; i < CPU_MAX; i++)
+		for (class = 0; class < HEAP_CLASSES; class++) {
+			info->magazine_blocks += heap_magazine[i][class].count;
+			info->magazine_free += heap_magazine[i][class].count * request2size(heap_class_size[class]);
+		}
+
+	eflags = heap_lock_acquire();
+
+	/* Nothing was allocated yet */
+	if (!av->top) {
+		heap_lock_release(eflags);
+		return;
+	}
+
+	for (i = 0; i < NFASTBINS; i++)
+		for (p = av->fastbins[i]; p; p = p->fd) {
+			info->fast_chunks++;
+			info->fast_free += chunksize(p);
+		}
+
+	info->top = chunksize(av->top);
+	info->free = info->top + info->fast_free;
+	info->free_chunks = 1;
+
+	for (i = 1; i < NBINS; i++) {
+		b = bin_at(av, i);
+		for (p = last(b); p != b; p = p->bk) {
+			info->free_chunks++;
+			info->free += chunksize(p);
+		}
+	}
+
+	info->arena = av->sbrked_mem;
+	info->max_arena = av->max_sbrked_mem;
+	info->used = info->arena - info->free;
+
+	heap_lock_release(eflags);
+}
+
+
 /* 
   -------------------- Alternative MORECORE functions --------------------
 */
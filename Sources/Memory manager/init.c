@@ -16,7 +16,6 @@
 
 /* From x86.asm */
 extern uint32_t _process_page_directory[1024];
-extern void _dummy_page_directory;
 extern void cpu_paging_enable(unsigned int page_dir_addr);
 
 
@@ -26,6 +25,8 @@ uint32_t table;
 
 	while (length--) {
 		mm_ppage_pop(&table, 1);
+		mm_page_set_owner(table, MM_OWNER_PAGE_TABLE);
+		mm_page_set_flags(table, MM_PAGE_FLAG_PINNED);
 		_process_page_directory[start_table++] = table | flags;
 		memory_clear((void *)table, CPU_PAGE_SIZE);
 	}
@@ -56,7 +57,7 @@ err_t mm_init(void)
 {
 err_t ret;
 uint32_t kernel_end;
-unsigned int flags;
+unsigned int i, flags, table_flags, heap_tables;
 
 	/*
 	 * Initialize memory manager subsystems
@@ -77,23 +78,50 @@ unsigned int flags;
 	if (_cpu.capabilities & CPU_CAPABILITY_GLOBALPAGES)
 		flags |= CPU_PAGE_FLAG_GLOBAL;
 
-	/* Allocate page tables for the entire kernel area, so every process has them all and any modification in the
-	 * kernel memory is automagically reflected on every process of the system */
-	allocate_kernel_page_tables(MM_AREA_KERNEL_START >> 22, (MM_AREA_KERNEL_END - MM_AREA_KERNEL_START) >> 22, flags);
+	/* Page directory entries are seen as page table entries through the self map, so they are never global */
+	table_flags = CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_PRESENT;
 
-	/* Map the entire kernel and the low memory into virtual memory */
-	map(0x00000, 0x00000, size_in_pages(kernel_end), flags);
+	/* Map the entire kernel and the low memory into virtual memory, with 4MB pages if the CPU supports them */
+	if (_cpu.capabilities & CPU_CAPABILITY_PSE) {
+		cpu_pse_enable();
+
+		for (i = 0; i < ((kernel_end + 0x3FFFFF) >> 22); i++)
+			_process_page_directory[i] = (i << 22) | flags | CPU_PAGE_FLAG_LARGE;
+	} else {
+		allocate_kernel_page_tables(0, (kernel_end + 0x3FFFFF) >> 22, table_flags);
+		map(0x00000, 0x00000, size_in_pages(kernel_end), flags);
+	}
+
+	/*
+	 * The other kernel page tables are created when needed in the kernel page directory, and copied to
+	 * the other page directories on their first access (see map.c). Only the ones which must be there
+	 * before anything can fault are allocated now, so every space created later gets them: the heap,
+	 * the windows used by the page fault handler and the thread stacks, which are still in use right
+	 * after a switch to another space. The heap area is big, but the heap cannot use more than the
+	 * memory there is, so only that much of it gets page tables.
+	 */
+	heap_tables = min((MM_AREA_HEAP_END - MM_AREA_HEAP_START) >> 22, (mm_ppage_get_total() + 1023) >> 10);
+	allocate_kernel_page_tables(MM_AREA_HEAP_START >> 22, heap_tables, table_flags);
+	mm_heap_init(heap_tables << 22);
+	allocate_kernel_page_tables(MM_AREA_WINDOW_START >> 22, 1, table_flags);
+	allocate_kernel_page_tables(MM_AREA_STACKS_START >> 22, (MM_AREA_STACKS_END - MM_AREA_STACKS_START) >> 22, table_flags);
 
 	/* Map the page directory itself at 0x02000000 */
-	_process_page_directory[0x02000000 >> 22] = (uint32_t)_process_page_directory | flags;
+	_process_page_directory[MM_AREA_PAGE_TABLES >> 22] = (uint32_t)_process_page_directory | table_flags;
 
 	/*
 	 * Enable paging
 	 */
 
 	cpu_paging_enable((unsigned int)_process_page_directory);
-	
-	mm_unmap_physical((uint32_t)&_dummy_page_directory >> 12, 1);
+
+	/* The kernel mappings were marked global, now they can really be */
+	if (_cpu.capabilities & CPU_CAPABILITY_GLOBALPAGES)
+		cpu_pge_enable();
+
+	ret = mm_vm_init();
+	if (ret)
+		return ret;
 
 	ret = mm_dma_init();
 	if (ret)
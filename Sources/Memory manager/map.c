@@ -14,38 +14,114 @@
 #include <cpu.h>
 #include <memory.h>
 #include <kernel.h>
+#include <process.h>
+#include <interrupt.h>
 
 /* From x86.asm */
 extern uint32_t _process_page_directory[1024];
-extern uint32_t _dummy_page_directory[1024];
 
-/* Get an existing page table or create a new one if not present */
+/********************
+ * Page table cache *
+ ********************/
+
+/* Cleared page tables given back by destroyed spaces, ready to be used again without clearing them */
+static uint32_t page_table_cache[MM_PAGE_TABLE_CACHE];
+static unsigned int page_table_cached;
+
+/* Get a cleared frame for a page table or a page directory */
+err_t mm_page_table_allocate(uint32_t *frame)
+{
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	if (page_table_cached) {
+		*frame = page_table_cache[--page_table_cached];
+
+		if (eflags & CPU_FLAG_INTERRUPT)
+			interrupt_enable();
+
+		return 0;
+	}
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return_on_failure(mm_ppage_pop_zeroed(frame));
+	mm_page_set_owner(*frame, MM_OWNER_PAGE_TABLE);
+
+	return 0;
+}
+
+/* Give back a page table. It must be cleared already, so it can be cached */
+void mm_page_table_free(uint32_t frame)
+{
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	if (page_table_cached < MM_PAGE_TABLE_CACHE)
+		page_table_cache[page_table_cached++] = frame;
+	else
+		mm_page_release(frame);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/*
+ * Kernel page tables are created in the kernel page directory, and copied to
+ * the current one when it does not have them yet. Returns 1 if it did.
+ */
+static int sync_kernel_page_table(unsigned index)
+{
+uint32_t *page_directory;
+
+	page_directory = (uint32_t *)MM_PAGE_DIRECTORY;
+
+	if ((index >= (MM_AREA_KERNEL_END >> 22)) || (page_directory[index] & CPU_PAGE_FLAG_PRESENT) ||
+		!(_process_page_directory[index] & CPU_PAGE_FLAG_PRESENT))
+		return 0;
+
+	page_directory[index] = _process_page_directory[index];
+
+	return 1;
+}
+
+/* Get an existing page table or create a new one if not present. Returns 0 if there is no memory for it */
 static uint32_t *get_create_page_table(unsigned index, unsigned flags)
 {
 uint32_t *page_table, *page_directory;
+uint32_t frame;
 
-	page_table = (uint32_t *)(0x02000000 + (index << 12));
-	page_directory = _process_page_directory;
+	page_table = (uint32_t *)(MM_AREA_PAGE_TABLES + (index << 12));
+	page_directory = (uint32_t *)MM_PAGE_DIRECTORY;
 		
-	if (!(page_directory[index] & CPU_PAGE_FLAG_PRESENT)) {
-		mm_ppage_pop(&page_directory[index], 1);
-		page_directory[index] |= flags;
+	if (!(page_directory[index] & CPU_PAGE_FLAG_PRESENT) && !sync_kernel_page_table(index)) {
+		if (mm_page_table_allocate(&frame))
+			return (uint32_t *)0;
 
-		memory_clear(page_table, CPU_PAGE_SIZE);
+		page_directory[index] = frame | (flags & (CPU_PAGE_FLAG_PRESENT | CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_USER));
+
+		if (index < (MM_AREA_KERNEL_END >> 22))
+			_process_page_directory[index] = page_directory[index];
 	}
 
 	return page_table;
 }
 
-/* Get an existing page table  */
+/* Get an existing page table. The 4MB pages have none */
 static uint32_t *get_page_table(unsigned index)
 {
-uint32_t *page_table, *page_directory;
+uint32_t *page_directory;
 
-	page_directory = _process_page_directory;
+	page_directory = (uint32_t *)MM_PAGE_DIRECTORY;
 
-	if (page_directory[index] & CPU_PAGE_FLAG_PRESENT)
-		return (uint32_t *)(0x02000000 + (index << 12));
+	if (((page_directory[index] & CPU_PAGE_FLAG_PRESENT) || sync_kernel_page_table(index)) &&
+		!(page_directory[index] & CPU_PAGE_FLAG_LARGE))
+		return (uint32_t *)(MM_AREA_PAGE_TABLES + (index << 12));
 	
 	return (uint32_t *)0;
 }
@@ -53,162 +129,374 @@ uint32_t *page_table, *page_directory;
 /*
  * Pay attention not to use mm_map and call mm_unmap_linear to free them, or
  * mm_map_linear and mm_unmap!
+ *
+ * When they run out of memory the map functions return ERROR_NO_MEMORY with
+ * the start of the range mapped, which the caller unmaps.
  */
 
-err_t mm_map(uint32_t start, uint32_t length, unsigned flags)
+err_t mm_map_owned(uint32_t start, uint32_t length, unsigned flags, unsigned int owner)
 {
 uint32_t *page_table;
-uint32_t start_table, end_table;
-uint32_t start_page, end_page;
-uint32_t count, i;
+uint32_t page, end;
+uint32_t start_page, count;
 
 	assert(!(flags & 0xFFFFF000));
 	flags |= CPU_PAGE_FLAG_PRESENT;
 
-	start_table = start >> 10;
-	end_table = (start + length) >> 10;
-
 	/* Check if there is enough memory left. Include in the computation the optionally needed page tables */
-	if ( mm_ppage_get_free() < (length + (length >> 10 + 1)) )
+	if ( mm_ppage_get_free() < (length + (length >> 10) + 2) )
 		return ERROR_NO_MEMORY;
 
-	for (i = start_table; i <= end_table; i++) {
-		/* Get the page table and if it doesn't exist, create one */
-		page_table = get_create_page_table(i, flags);
+	end = start + length;
 
-		start_page = max(start_table * 1024, start) & 0x3FF;
-		count = min(1024 - start_page, length);
+	for (page = start; page < end; page += count) {
+		/* Get the page table and if it doesn't exist, create one */
+		page_table = get_create_page_table(page >> 10, flags);
+		if (!page_table)
+			return ERROR_NO_MEMORY;
 
-		mm_ppage_pop(&page_table[start_page], count);
+		start_page = page & 0x3FF;
+		count = min(1024 - start_page, end - page);
 
-		length -= count;
+		/* Nothing is taken when it fails, but the entries were written over */
+		if (mm_ppage_pop(&page_table[start_page], count)) {
+			memory_clear(&page_table[start_page], count * sizeof(uint32_t));
+			return ERROR_NO_MEMORY;
+		}
 
-		/* Set flags */
-		while (count--)
-			page_table[start_page++] |= flags;
+		/* Set flags and owner */
+		for (; start_page < (page & 0x3FF) + count; start_page++) {
+			mm_page_set_owner(page_table[start_page], owner);
+			page_table[start_page] |= flags;
+		}
 	}
 
 	return 0;
 }
 
-err_t mm_map_physical(uint32_t virtual, uint32_t physical, uint32_t length, unsigned flags)
+err_t mm_map(uint32_t start, uint32_t length, unsigned flags)
+{
+	return mm_map_owned(start, length, flags, (flags & CPU_PAGE_FLAG_USER) ? MM_OWNER_USER : MM_OWNER_KERNEL);
+}
+
+/* Map a physical range. Replaced mappings are added to the TLB gather */
+err_t mm_map_physical_gather(struct mm_tlb_gather *tlb, uint32_t virtual, uint32_t physical, uint32_t length, unsigned flags)
 {
 uint32_t *page_table;
-uint32_t start_table, end_table;
-uint32_t start_page, end_page;
-uint32_t count, i;
+uint32_t page, end;
+uint32_t start_page, count;
 
 	assert(!(flags & 0xFFFFF000));
 	flags |= CPU_PAGE_FLAG_PRESENT;
 	physical <<= 12;
 
-	start_table = virtual >> 10;
-	end_table = (virtual + length) >> 10;
+	end = virtual + length;
 
-	for (i = start_table; i <= end_table; i++) {
+	for (page = virtual; page < end; page += count) {
 		/* Get the page table and if it doesn't exist, create one */
-		page_table = get_create_page_table(i, flags);
+		page_table = get_create_page_table(page >> 10, flags);
+		if (!page_table)
+			return ERROR_NO_MEMORY;
+
+		start_page = page & 0x3FF;
+		count = min(1024 - start_page, end - page);
 
-		start_page = max(start_table * 1024, virtual) & 0x3FF;
-		count = min(1024 - start_page, length);
+		for (; start_page < (page & 0x3FF) + count; start_page++) {
+			if (page_table[start_page] & CPU_PAGE_FLAG_PRESENT)
+				mm_tlb_gather_add(tlb, (page & ~0x3FF) + start_page, 1);
 
-		while (count--) {
-			page_table[start_page++] = physical | flags;
+			page_table[start_page] = physical | flags;
 			physical += 0x1000;
 		}
-
-		length -= count;
 	}
 
 	return 0;
 }
 
+err_t mm_map_physical(uint32_t virtual, uint32_t physical, uint32_t length, unsigned flags)
+{
+struct mm_tlb_gather tlb;
+err_t ret;
 
+	mm_tlb_gather_init(&tlb);
+	ret = mm_map_physical_gather(&tlb, virtual, physical, length, flags);
+	mm_tlb_gather_flush(&tlb);
 
+	return ret;
+}
 
-void mm_unmap(uint32_t start, uint32_t length)
+
+
+
+/*
+ * Unmap a range, adding it to the TLB gather. The caller flushes the gather before the pages are reused.
+ * Parts of the range which never had a page table are skipped.
+ */
+void mm_unmap_gather(struct mm_tlb_gather *tlb, uint32_t start, uint32_t length)
 {
 uint32_t *page_table;
-uint32_t start_table, end_table;
-uint32_t start_page, end_page;
-uint32_t end, count, i;
+uint32_t page, end;
+uint32_t start_page, count;
 
-	start_table = start >> 10;
-	end_table = (start + length) >> 10;
 	end = start + length;
 
-	for (i = start_table; i < end_table; i++) {
+	for (page = start; page < end; page += count) {
+		start_page = page & 0x3FF;
+		count = min(1024 - start_page, end - page);
+
 		/* Get the page table */
-		page_table = get_page_table(i);
-		assert(page_table);
+		page_table = get_page_table(page >> 10);
+		if (!page_table)
+			continue;
+
+		/* Drop the reference of every mapping. The frame is freed with the last one */
+		for (; start_page < (page & 0x3FF) + count; start_page++) {
+			if (page_table[start_page] & CPU_PAGE_FLAG_PRESENT)
+				mm_page_release(page_table[start_page] & 0xFFFFF000);
+
+			page_table[start_page] = 0;
+		}
+	}
+
+	mm_tlb_gather_add(tlb, start, length);
+}
 
-		start_page = max(start_table * 1024, start);
-		count = min(1024, end);
+void mm_unmap(uint32_t start, uint32_t length)
+{
+struct mm_tlb_gather tlb;
 
-		/* Remove flags */
-		while (count--)
-			page_table[start_page++] &= 0xFFFFF000;
+	mm_tlb_gather_init(&tlb);
+	mm_unmap_gather(&tlb, start, length);
+	mm_tlb_gather_flush(&tlb);
+}
 
-		start_page = max(start_table * 1024, start);
-		count = min(1024, end);
+void mm_unmap_physical_gather(struct mm_tlb_gather *tlb, uint32_t start, uint32_t length)
+{
+uint32_t *page_table;
+uint32_t page, end;
+uint32_t start_page, count;
 
-		mm_ppage_push(&page_table[start_page], count);
+	end = start + length;
 
-		end -= count;
+	for (page = start; page < end; page += count) {
+		start_page = page & 0x3FF;
+		count = min(1024 - start_page, end - page);
+
+		/* Get the page table. A map which ran out of memory may have left it out */
+		page_table = get_page_table(page >> 10);
+		if (!page_table)
+			continue;
+
+		memory_clear(&page_table[start_page], count * sizeof(uint32_t));
 	}
 
-	cpu_mmu_invalidate(start, length);
+	mm_tlb_gather_add(tlb, start, length);
 }
 
 void mm_unmap_physical(uint32_t start, uint32_t length)
 {
+struct mm_tlb_gather tlb;
+
+	mm_tlb_gather_init(&tlb);
+	mm_unmap_physical_gather(&tlb, start, length);
+	mm_tlb_gather_flush(&tlb);
+}
+
+/**********************
+ * Demand paged areas *
+ **********************/
+
+/*
+ * Reserve a range without backing it. The entries are left not present, with
+ * MM_PAGE_RESERVED and the owner in the frame bits, and get a cleared frame on
+ * the first access. Pages which are already present are left alone.
+ */
+err_t mm_reserve(uint32_t start, uint32_t length, unsigned flags, unsigned int owner)
+{
 uint32_t *page_table;
-uint32_t start_table, end_table;
-uint32_t start_page, end_page;
-uint32_t end, count, i;
+uint32_t page, end;
+uint32_t start_page, count;
 
-	start_table = start >> 10;
-	end_table = (start + length) >> 10;
-	end = start + length;
+	assert(!(flags & 0xFFFFF000));
+	assert(owner != MM_OWNER_FREE && owner < MM_OWNERS);
 
-	for (i = start_table; i < end_table; i++) {
-		/* Get the page table */
-		page_table = get_page_table(i);
-		assert(page_table);
+	end = start + length;
 
-		start_page = max(start_table * 1024, start);
-		count = min(1024, end);
+	for (page = start; page < end; page += count) {
+		page_table = get_create_page_table(page >> 10, flags | CPU_PAGE_FLAG_PRESENT);
+		if (!page_table)
+			return ERROR_NO_MEMORY;
 
-		memory_clear(&page_table[start_page], count * sizeof(uint32_t));
+		start_page = page & 0x3FF;
+		count = min(1024 - start_page, end - page);
 
-		end -= count;
+		for (; start_page < (page & 0x3FF) + count; start_page++)
+			if (!(page_table[start_page] & CPU_PAGE_FLAG_PRESENT))
+				page_table[start_page] = (owner << 12) | MM_PAGE_RESERVED | flags;
 	}
 
-	cpu_mmu_invalidate(start, length);
+	return 0;
 }
 
-
-err_t mm_map_page_directory(uint32_t page_dir)
+/* Give a frame to a reserved entry */
+static err_t map_reserved(uint32_t *entry)
 {
+uint32_t frame;
 err_t ret;
 
-	// Map it on the dummy page directory placeholder
-	ret = mm_map_physical((uint32_t)&_dummy_page_directory >> 12, page_dir >> 12, 1, CPU_PAGE_FLAG_WRITABLE);
-	
-	// An invalidate is needed because the map function does not invalidate the caches and
-	// no unmap will ever be called for a page directory map.
-	cpu_mmu_invalidate((uint32_t)&_dummy_page_directory >> 12, 1);
-	
+	ret = mm_ppage_pop_zeroed(&frame);
 	if (ret)
 		return ret;
 
+	mm_page_set_owner(frame, *entry >> 12);
+	*entry = frame | (*entry & 0xFFF & ~MM_PAGE_RESERVED) | CPU_PAGE_FLAG_PRESENT;
+
+	return 0;
+}
+
+/*
+ * Back the reserved pages of a range right now. Needed for memory that must
+ * never fault, such as the stacks the processor switches to.
+ */
+err_t mm_map_commit(uint32_t start, uint32_t length)
+{
+uint32_t *page_table;
+uint32_t page;
+
+	for (page = start; page < start + length; page++) {
+		page_table = get_page_table(page >> 10);
+		assert(page_table);
+
+		if (page_table[page & 0x3FF] & MM_PAGE_RESERVED)
+			return_on_failure(map_reserved(&page_table[page & 0x3FF]));
+	}
+
+	return 0;
+}
+
+/* Break the sharing of a copy on write page. The last one to write keeps the frame */
+static err_t map_cow(uint32_t address, uint32_t *entry)
+{
+struct mm_tlb_gather tlb;
+struct mm_page *page;
+uint32_t frame;
+err_t ret;
+
+	page = mm_page_get(*entry & 0xFFFFF000);
+
+	if (page->count > 1) {
+		ret = mm_ppage_pop(&frame, 1);
+		if (ret)
+			return ret;
+
+		mm_page_set_owner(frame, page->owner);
+
+		memory_copy(mm_kmap(MM_KMAP_COPY, frame), (void *)(address & 0xFFFFF000), CPU_PAGE_SIZE);
+
+		mm_page_release(*entry & 0xFFFFF000);
+		*entry = frame | (*entry & 0xFFF);
+	}
+
+	*entry = (*entry & ~MM_PAGE_COW) | CPU_PAGE_FLAG_WRITABLE;
+
+	/* Other threads of the process may still see the shared frame */
+	mm_tlb_gather_init(&tlb);
+	mm_tlb_gather_add(&tlb, address >> 12, 1);
+	mm_tlb_gather_flush(&tlb);
+
 	return 0;
 }
 
+/* Page fault handler. Returns 0 when the access can be restarted */
+err_t mm_map_fault(uint32_t address, uint32_t error_code)
+{
+uint32_t *page_table, *entry = 0;
+
+	/* A kernel page table created while another space was running */
+	if (sync_kernel_page_table(address >> 22))
+		return 0;
+
+	page_table = get_page_table(address >> 22);
+	if (page_table)
+		entry = &page_table[(address >> 12) & 0x3FF];
+
+	/* The only protection violations resolved here are writes to copy on write pages */
+	if (entry && (error_code & CPU_PAGE_FAULT_PRESENT)) {
+		if ((error_code & CPU_PAGE_FAULT_WRITE) && (*entry & MM_PAGE_COW))
+			return map_cow(address, entry);
+
+		/* Another processor resolved it first, and the TLB entry which faulted is gone */
+		if ((error_code & CPU_PAGE_FAULT_WRITE) && (*entry & CPU_PAGE_FLAG_WRITABLE) &&
+			(!(error_code & CPU_PAGE_FAULT_USER) || (*entry & CPU_PAGE_FLAG_USER)))
+			return 0;
+
+		return ERROR_INVALID;
+	}
+
+	if (entry && (*entry & MM_PAGE_RESERVED)) {
+		/* User code cannot touch kernel reservations */
+		if ((error_code & CPU_PAGE_FAULT_USER) && !(*entry & CPU_PAGE_FLAG_USER))
+			return ERROR_INVALID;
+
+		/* Not present entries are never cached by the TLB, so no invalidation is needed */
+		return map_reserved(entry);
+	}
+
+	/* Otherwise the areas of the process tell if the page should be there */
+	if ((address >= MM_AREA_USER_START) && current_process)
+		return mm_vma_fault(&current_process->vmas, address, error_code);
+
+	return ERROR_NOT_FOUND;
+}
+
+/* Change the protection of a range, whether it is backed or only reserved */
+void mm_protect(uint32_t start, uint32_t length, unsigned flags)
+{
+struct mm_tlb_gather tlb;
+uint32_t *page_table, *entry;
+struct mm_page *frame;
+uint32_t page;
+unsigned int shared;
+
+	assert(!(flags & ~(CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_USER)));
+	mm_tlb_gather_init(&tlb);
+
+	for (page = start; page < start + length; page++) {
+		page_table = get_page_table(page >> 10);
+		if (!page_table) {
+			/* Nothing to change up to the next page table */
+			page |= 0x3FF;
+			continue;
+		}
+
+		entry = &page_table[page & 0x3FF];
+		if (!(*entry & (CPU_PAGE_FLAG_PRESENT | MM_PAGE_RESERVED)))
+			continue;
+
+		shared = (*entry & CPU_PAGE_FLAG_PRESENT) && (frame = mm_page_get(*entry & 0xFFFFF000)) && (frame->count > 1);
+		*entry &= ~(CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_USER | MM_PAGE_COW);
+
+		/* Shared frames only become writable through a copy */
+		if (shared && (flags & CPU_PAGE_FLAG_WRITABLE))
+			*entry |= MM_PAGE_COW | (flags & CPU_PAGE_FLAG_USER);
+		else
+			*entry |= flags;
+
+		if (*entry & CPU_PAGE_FLAG_PRESENT)
+			mm_tlb_gather_add(&tlb, page, 1);
+	}
+
+	mm_tlb_gather_flush(&tlb);
+}
+
+
 err_t mm_map_check(uint32_t page)
 {
 uint32_t *page_table;
 
+	if (((uint32_t *)MM_PAGE_DIRECTORY)[page >> 10] & CPU_PAGE_FLAG_LARGE)
+		return 0;
+
 	page_table = get_page_table(page >> 10);
 	if (!page_table)
 		return ERROR_NOT_FOUND;
@@ -219,4 +507,64 @@ uint32_t *page_table;
 	return ERROR_NOT_FOUND;
 }
 
+/* Get the physical address a virtual address is mapped to */
+err_t mm_map_translate(uint32_t virtual, uint32_t *physical)
+{
+uint32_t *page_table;
+uint32_t entry;
+
+	entry = ((uint32_t *)MM_PAGE_DIRECTORY)[virtual >> 22];
+	if (entry & CPU_PAGE_FLAG_LARGE) {
+		*physical = (entry & 0xFFC00000) | (virtual & 0x3FFFFF);
+		return 0;
+	}
+
+	page_table = get_page_table(virtual >> 22);
+	if (!page_table)
+		return ERROR_NOT_FOUND;
+
+	entry = page_table[(virtual >> 12) & 0x3FF];
+	if (!(entry & CPU_PAGE_FLAG_PRESENT))
+		return ERROR_NOT_FOUND;
+
+	*physical = (entry & 0xFFFFF000) | (virtual & 0xFFF);
+
+	return 0;
+}
+
+/******************
+ * Temporary maps *
+ ******************/
+
+/* Slots of the running processor */
+#define kmap_base()	(MM_AREA_WINDOW_START + ((cpu_current() * MM_KMAP_SLOTS) << 12))
+
+/*
+ * Map a physical frame on a temporary slot of this processor, and return its
+ * address. The mapping lasts until the next mm_kmap on the same slot, so the
+ * caller must keep interrupts disabled while using it: on this processor only
+ * (cpu_interrupt_save) is enough, since no other one uses the slots. Mapping
+ * again the frame a slot already holds costs no TLB flush.
+ */
+void *mm_kmap(unsigned int slot, uint32_t frame)
+{
+uint32_t address, *entry;
 
+	assert(slot < MM_KMAP_SLOTS);
+
+	address = kmap_base() + (slot << 12);
+	entry = &MM_PAGE_TABLE_ENTRY(address >> 12);
+
+	if ((*entry & (0xFFFFF000 | CPU_PAGE_FLAG_PRESENT)) != ((frame & 0xFFFFF000) | CPU_PAGE_FLAG_PRESENT)) {
+		*entry = (frame & 0xFFFFF000) | CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_PRESENT;
+		cpu_mmu_invalidate(address >> 12, 1);
+	}
+
+	return (void *)address;
+}
+
+/* Clear a physical frame through its temporary slot. Interrupts must be disabled, at least on this processor */
+void mm_map_clear_frame(uint32_t frame)
+{
+	memory_clear(mm_kmap(MM_KMAP_ZERO, frame), CPU_PAGE_SIZE);
+}
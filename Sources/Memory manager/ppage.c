@@ -16,16 +16,77 @@
 #include <bios.h>
 #include <string.h>
 #include <memory.h>
+#include <kernel.h>
+#include <cpu.h>
+#include <interrupt.h>
 
 /* From kernel.ld */
 extern void _end;
 
-/* From x86.asm */
-extern void _dummy_page_directory;
+/*
+ * Every usable e820 range gets its own buddy allocator (an extent), so the
+ * bitmaps only cover memory that really exists and holes cost nothing.
+ * Ranges crossing the ISA DMA limit are split, so an extent always belongs
+ * to a single zone.
+ */
+#define PPAGE_MAX_EXTENTS	32
 
-static uint32_t *ppage_stack_ptr = (uint32_t *)&_end;
+static struct mm_buddy ppage_extent[PPAGE_MAX_EXTENTS];
+static unsigned int ppage_extents = 0;
+
+/*
+ * The page frame database has an entry for every frame covered by an extent,
+ * stored after the extent bitmaps. Entries are two bytes, so with the bitmaps
+ * the metadata of 4GB is about 2.3MB. Frames sitting in the allocator are
+ * owned by MM_OWNER_FREE and have no references.
+ */
+static struct mm_page *ppage_database[PPAGE_MAX_EXTENTS];
+static unsigned int ppage_owner_frames[MM_OWNERS];
+
+/*
+ * Zones group consecutive extents. Allocations that fall back to another
+ * zone cannot take it below its watermark, so the DMA zone keeps some
+ * memory for the drivers that cannot use anything else.
+ */
+static struct mm_zone {
+	unsigned char	*name;
+	unsigned int	first_extent;
+	unsigned int	extents;
+	unsigned int	total_frames;
+	unsigned int	watermark;		/* Frames kept away from fallback allocations */
+} ppage_zone[MM_ZONES] = {
+	{ "DMA", 0, 0, 0, 0 },
+	{ "Normal", 0, 0, 0, 0 }
+};
+
+/* Fallback order of each zone */
+static const unsigned int ppage_zone_fallback[MM_ZONES][MM_ZONES] = {
+	{ MM_ZONE_DMA, MM_ZONES },
+	{ MM_ZONE_NORMAL, MM_ZONE_DMA }
+};
+
+/*
+ * Single frames are handed out from a small stack which is refilled from
+ * and drained to the buddy allocators in batches, so the common one-page
+ * case stays a memory copy.
+ */
+#define PPAGE_CACHE_SIZE	512
+#define PPAGE_CACHE_BATCH	128
+
+static uint32_t ppage_cache[PPAGE_CACHE_SIZE];
+static uint32_t *ppage_stack_ptr = ppage_cache;
 static unsigned int total_pages = 0, free_pages = 0;
 
+/*
+ * The idle thread keeps a pool of cleared frames, so page tables and page
+ * directories do not have to be cleared while someone waits for them.
+ * Frames in the pool are still counted as free.
+ */
+#define PPAGE_ZERO_POOL_SIZE	64
+
+static uint32_t ppage_zero_pool[PPAGE_ZERO_POOL_SIZE];
+static unsigned int ppage_zero_count = 0;
+
 
 inline unsigned int mm_ppage_get_free(void)
 {
@@ -37,6 +98,246 @@ inline unsigned int mm_ppage_get_total(void)
 	return total_pages;
 }
 
+/* Free frames in the buddy allocators of a zone. Frames in the single page cache are not counted */
+unsigned int mm_ppage_get_zone_free(unsigned int zone)
+{
+unsigned int i, count = 0;
+
+	for (i = 0; i < ppage_zone[zone].extents; i++)
+		count += ppage_extent[ppage_zone[zone].first_extent + i].free_frames;
+
+	return count;
+}
+
+unsigned int mm_ppage_get_zone_total(unsigned int zone)
+{
+	return ppage_zone[zone].total_frames;
+}
+
+/* Index of the extent containing the frame, or ppage_extents if there is none */
+static unsigned int ppage_extent_lookup(uint32_t frame)
+{
+unsigned int i;
+
+	for (i = 0; i < ppage_extents; i++)
+		if ((frame >= ppage_extent[i].base) && (frame - ppage_extent[i].base < ppage_extent[i].frames))
+			break;
+
+	return i;
+}
+
+static struct mm_buddy *ppage_extent_find(uint32_t frame)
+{
+unsigned int i;
+
+	i = ppage_extent_lookup(frame);
+	if (i == ppage_extents)
+		kernel_bug("Frame %#X does not belong to any physical memory range", frame);
+
+	return &ppage_extent[i];
+}
+
+/***********************
+ * Page frame database *
+ ***********************/
+
+/* Get the database entry of a physical address, or 0 if it is not RAM we manage (e.g. device memory) */
+struct mm_page *mm_page_get(uint32_t ptr)
+{
+unsigned int i;
+
+	i = ppage_extent_lookup(ptr >> 12);
+	if (i == ppage_extents)
+		return 0;
+
+	return &ppage_database[i][(ptr >> 12) - ppage_extent[i].base];
+}
+
+/* A frame left the allocator: it starts with a single reference, owned by the kernel */
+static void ppage_page_allocated(uint32_t ptr)
+{
+struct mm_page *page = mm_page_get(ptr);
+
+	page->count = 1;
+	page->flags = 0;
+	page->owner = MM_OWNER_KERNEL;
+	ppage_owner_frames[MM_OWNER_KERNEL]++;
+}
+
+static void ppage_page_freed(uint32_t ptr)
+{
+struct mm_page *page = mm_page_get(ptr);
+
+	/* Frames which were never allocated (such as ACPI tables) have no owner to discount */
+	if (page->owner != MM_OWNER_FREE)
+		ppage_owner_frames[page->owner]--;
+
+	page->count = 0;
+	page->flags = 0;
+	page->owner = MM_OWNER_FREE;
+}
+
+void mm_page_set_owner(uint32_t ptr, unsigned int owner)
+{
+struct mm_page *page = mm_page_get(ptr);
+
+	if (!page)
+		return;
+
+	assert(owner != MM_OWNER_FREE && owner < MM_OWNERS);
+
+	/* Free frames are not counted per owner, and must stay MM_OWNER_FREE */
+	if (!page->count)
+		kernel_bug("Setting the owner of free frame %#X", ptr >> 12);
+
+	ppage_owner_frames[page->owner]--;
+	ppage_owner_frames[owner]++;
+	page->owner = owner;
+}
+
+void mm_page_set_flags(uint32_t ptr, unsigned int flags)
+{
+struct mm_page *page = mm_page_get(ptr);
+
+	if (page)
+		page->flags |= flags;
+}
+
+/*
+ * Add a reference to an allocated frame, e.g. when it gets mapped somewhere
+ * else too. Fails with ERROR_OUT_OF_BOUNDS when it has MM_PAGE_COUNT_MAX
+ */
+err_t mm_page_reference(uint32_t ptr)
+{
+struct mm_page *page = mm_page_get(ptr);
+
+	if (!page)
+		return 0;
+
+	if (!page->count)
+		kernel_bug("Referencing free frame %#X", ptr >> 12);
+
+	if (page->count == MM_PAGE_COUNT_MAX)
+		return ERROR_OUT_OF_BOUNDS;
+
+	page->count++;
+
+	return 0;
+}
+
+/* Drop a reference to a frame. The frame goes back to the allocator with the last one, unless pinned */
+void mm_page_release(uint32_t ptr)
+{
+struct mm_page *page = mm_page_get(ptr);
+
+	if (!page)
+		return;
+
+	if (!page->count)
+		kernel_bug("Releasing free frame %#X", ptr >> 12);
+
+	if (--page->count || (page->flags & MM_PAGE_FLAG_PINNED))
+		return;
+
+	ptr &= 0xFFFFF000;
+	mm_ppage_push(&ptr, 1);
+}
+
+/*
+ * Drop a reference to every frame of an array. The frames left without any go
+ * back to the allocator with a single push, packed at the start of the array.
+ */
+void mm_page_release_array(uint32_t *ptr, size_t count)
+{
+struct mm_page *page;
+size_t i, freed = 0;
+
+	for (i = 0; i < count; i++) {
+		page = mm_page_get(ptr[i]);
+		if (!page)
+			continue;
+
+		if (!page->count)
+			kernel_bug("Releasing free frame %#X", ptr[i] >> 12);
+
+		if (--page->count || (page->flags & MM_PAGE_FLAG_PINNED))
+			continue;
+
+		ptr[freed++] = ptr[i] & 0xFFFFF000;
+	}
+
+	if (freed)
+		mm_ppage_push(ptr, freed);
+}
+
+/* Frames held by an owner. Free frames are not tracked in the database, so ask the allocator */
+unsigned int mm_page_get_owner_count(unsigned int owner)
+{
+	if (owner == MM_OWNER_FREE)
+		return free_pages;
+
+	return ppage_owner_frames[owner];
+}
+
+/**************************
+ * Allocation and freeing *
+ **************************/
+
+/* Allocate from the extents of a single zone, preferring the highest memory */
+static err_t ppage_zone_allocate(unsigned int zone, unsigned int order, unsigned int watermark, uint32_t *frame)
+{
+struct mm_zone *z = &ppage_zone[zone];
+unsigned int i;
+
+	if (watermark && (mm_ppage_get_zone_free(zone) < watermark + (1 << order)))
+		return ERROR_NO_MEMORY;
+
+	for (i = z->first_extent + z->extents; i-- > z->first_extent; )
+		if (!mm_buddy_allocate(&ppage_extent[i], order, frame))
+			return 0;
+
+	return ERROR_NO_MEMORY;
+}
+
+/* Allocate from the given zone, falling back to the others while they are above their watermark */
+static err_t ppage_extent_allocate(unsigned int zone, unsigned int order, uint32_t *frame)
+{
+unsigned int i, cur_zone;
+
+	for (i = 0; i < MM_ZONES; i++) {
+		cur_zone = ppage_zone_fallback[zone][i];
+		if (cur_zone == MM_ZONES)
+			break;
+
+		if (!ppage_zone_allocate(cur_zone, order, cur_zone == zone ? 0 : ppage_zone[cur_zone].watermark, frame))
+			return 0;
+	}
+
+	return ERROR_NO_MEMORY;
+}
+
+static void ppage_cache_refill(size_t count)
+{
+uint32_t frame;
+
+	while (count--) {
+		if (ppage_extent_allocate(MM_ZONE_NORMAL, 0, &frame))
+			return;
+
+		*ppage_stack_ptr++ = frame << 12;
+	}
+}
+
+static void ppage_cache_drain(size_t count)
+{
+uint32_t frame;
+
+	while (count--) {
+		frame = *--ppage_stack_ptr >> 12;
+		mm_buddy_free(ppage_extent_find(frame), frame, 0);
+	}
+}
+
 err_t mm_ppage_pop(uint32_t *ptr, size_t count)
 {
 /* Check MUST be done outside this function to improve performance.
@@ -44,28 +345,187 @@ err_t mm_ppage_pop(uint32_t *ptr, size_t count)
 		return ERROR_NO_MEMORY;
 */
 
-int i;
+uint32_t *start = ptr;
+size_t cached, i;
+
+	while (count) {
+		if (ppage_stack_ptr == ppage_cache) {
+			ppage_cache_refill(PPAGE_CACHE_BATCH);
+
+			/* Last resort: the zeroed pages are as good as any other */
+			while ((ppage_stack_ptr == ppage_cache) && ppage_zero_count)
+				*ppage_stack_ptr++ = ppage_zero_pool[--ppage_zero_count];
+
+			/* Give back what was taken, so the caller has nothing to undo */
+			if (ppage_stack_ptr == ppage_cache) {
+				mm_ppage_push(start, ptr - start);
+				return ERROR_NO_MEMORY;
+			}
+		}
 
-	ppage_stack_ptr -= count;
-	free_pages -= count;
+		cached = min(count, ppage_stack_ptr - ppage_cache);
+		free_pages -= cached;
 
-	memory_copy(ptr, ppage_stack_ptr, count * sizeof(uint32_t));
+		ppage_stack_ptr -= cached;
+		memory_copy(ptr, ppage_stack_ptr, cached * sizeof(uint32_t));
+
+		for (i = 0; i < cached; i++)
+			ppage_page_allocated(ptr[i]);
+
+		ptr += cached;
+		count -= cached;
+	}
 
 	return 0;
 }
 
 void mm_ppage_push(uint32_t *ptr, size_t count)
 {
-	memory_copy(ppage_stack_ptr, ptr, count * sizeof(uint32_t));
+size_t room, i;
 
-	ppage_stack_ptr += count;
 	free_pages += count;
 
+	for (i = 0; i < count; i++)
+		ppage_page_freed(ptr[i]);
+
 	/* We may be pushing memory that was not counted in mm_ppage_init (such as ACPI tables) so adjust total memory */
 	if (free_pages > total_pages)
 		total_pages = free_pages;
+
+	while (count) {
+		if (ppage_stack_ptr == &ppage_cache[PPAGE_CACHE_SIZE])
+			ppage_cache_drain(PPAGE_CACHE_BATCH);
+
+		room = min(count, &ppage_cache[PPAGE_CACHE_SIZE] - ppage_stack_ptr);
+
+		memory_copy(ppage_stack_ptr, ptr, room * sizeof(uint32_t));
+		ppage_stack_ptr += room;
+
+		ptr += room;
+		count -= room;
+	}
+}
+
+/*
+ * Allocate 2^order physically contiguous pages from a zone, aligned to their size.
+ * The physical address of the first page is put in ptr.
+ */
+err_t mm_ppage_allocate_zone(unsigned int zone, unsigned int order, uint32_t *ptr)
+{
+uint32_t frame, i;
+err_t ret;
+
+	if ((zone >= MM_ZONES) || (order >= MM_BUDDY_ORDERS))
+		return ERROR_INVALID;
+
+	ret = ppage_extent_allocate(zone, order, &frame);
+	if (ret && ppage_stack_ptr != ppage_cache) {
+		/* Cached single frames may be what keeps a bigger block split */
+		ppage_cache_drain(ppage_stack_ptr - ppage_cache);
+		ret = ppage_extent_allocate(zone, order, &frame);
+	}
+	if (ret)
+		return ret;
+
+	free_pages -= 1 << order;
+	*ptr = frame << 12;
+
+	for (i = 0; i < (1 << order); i++)
+		ppage_page_allocated((frame + i) << 12);
+
+	return 0;
+}
+
+err_t mm_ppage_allocate(unsigned int order, uint32_t *ptr)
+{
+	return mm_ppage_allocate_zone(MM_ZONE_NORMAL, order, ptr);
+}
+
+void mm_ppage_free(uint32_t ptr, unsigned int order)
+{
+uint32_t i;
+
+	for (i = 0; i < (1 << order); i++)
+		ppage_page_freed(ptr + (i << 12));
+
+	mm_buddy_free(ppage_extent_find(ptr >> 12), ptr >> 12, order);
+	free_pages += 1 << order;
+}
+
+
+/****************
+ * Zeroed pages *
+ ****************/
+
+/* Get a page which is already cleared. If the pool is empty, the page is cleared now */
+err_t mm_ppage_pop_zeroed(uint32_t *ptr)
+{
+uint32_t eflags;
+err_t ret = 0;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	if (ppage_zero_count) {
+		*ptr = ppage_zero_pool[--ppage_zero_count];
+		ppage_page_allocated(*ptr);
+		free_pages--;
+	} else {
+		ret = mm_ppage_pop(ptr, 1);
+		if (!ret)
+			mm_map_clear_frame(*ptr);
+	}
+
+	if (!ret)
+		mm_page_set_flags(*ptr, MM_PAGE_FLAG_ZEROED);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return ret;
 }
 
+/*
+ * Fill the zeroed page pool. Called by the idle thread, a page at a time. The
+ * frame is cleared through a temporary slot of this processor, so the other
+ * processors are not held off meanwhile.
+ */
+void mm_ppage_zero_refill(void)
+{
+uint32_t eflags, frame;
+
+	while (ppage_zero_count < PPAGE_ZERO_POOL_SIZE) {
+		eflags = cpu_flags_get();
+		interrupt_disable();
+
+		if (mm_ppage_pop(&frame, 1)) {
+			if (eflags & CPU_FLAG_INTERRUPT)
+				interrupt_enable();
+			return;
+		}
+
+		if (eflags & CPU_FLAG_INTERRUPT)
+			interrupt_enable();
+
+		eflags = cpu_interrupt_save();
+		mm_map_clear_frame(frame);
+		cpu_interrupt_restore(eflags);
+
+		eflags = cpu_flags_get();
+		interrupt_disable();
+
+		// Another idle thread may have filled the pool meanwhile
+		if (ppage_zero_count < PPAGE_ZERO_POOL_SIZE) {
+			ppage_page_freed(frame);
+			ppage_zero_pool[ppage_zero_count++] = frame;
+			free_pages++;
+		} else
+			mm_ppage_push(&frame, 1);
+
+		if (eflags & CPU_FLAG_INTERRUPT)
+			interrupt_enable();
+	}
+}
 
 /******************
  * Initialization *
@@ -73,7 +533,9 @@ void mm_ppage_push(uint32_t *ptr, size_t count)
 
 err_t mm_ppage_init_map(uint32_t *kernel_end)
 {
-unsigned int i, mmap_entries;
+unsigned int i, piece, mmap_entries;
+size_t metadata_size = 0;
+uint32_t *metadata, metadata_end;
 
 	mmap_entries = _multiboot->mmap_length / sizeof(struct e820_map_entry);
 
@@ -102,51 +564,105 @@ unsigned int i, mmap_entries;
 		}
 	}
 
-	/* Now push available RAM on the stack (that is, memory > (0x100000 + kernel size)) */
-	for (i = 0; i < mmap_entries; i++) {
-		#define entry _multiboot->mmap_entry[i]
+	/*
+	 * Create an extent for every range we may ever give out: available RAM and the ACPI
+	 * tables, which become available once read. Memory below 1MB is left to the DMA pool
+	 * and memory above 4GB cannot be addressed.
+	 */
+	#define entry _multiboot->mmap_entry[i]
+	#define usable(e)	(((e).type == typeAvailable || (e).type == typeACPI) && \
+				 ((e).base_addr >= 0x100000) && ((e).base_addr < 0x100000000ULL))
+
+	/* Each range is looked at as its part below the DMA limit and its part above it */
+	#define piece_start(e, piece)	((piece) ? max(((e).base_addr + 0xFFF) >> 12, MM_ZONE_DMA_END >> 12) \
+						 : (((e).base_addr + 0xFFF) >> 12))
+	#define piece_end(e, piece)	((piece) ? (((e).base_addr + (e).length) >> 12) \
+						 : min(((e).base_addr + (e).length) >> 12, MM_ZONE_DMA_END >> 12))
+
+	/* The database covers the same frames as the buddy bitmaps, from the aligned base. It is kept word aligned */
+	#define database_size(start, end)	((((end) - ((start) & ~((1 << (MM_BUDDY_ORDERS - 1)) - 1))) * sizeof(struct mm_page) + 3) & ~3)
 
-		if ((entry.type != typeAvailable) || (entry.base_addr < 0x100000))
+	for (i = 0; i < mmap_entries; i++) {
+		if (!usable(entry))
 			continue;
 
-		if ( entry.base_addr < (unsigned int)&_end ) {
-	
-			/* If the area spans the kernel, remove the used area */
-			if ( (entry.base_addr + entry.length) > (unsigned int)&_end ) {
-				entry.length -= (unsigned int)&_end - entry.base_addr;
-				entry.base_addr = (unsigned int)&_end;
-			} else {
+		if (entry.base_addr + entry.length > 0x100000000ULL)
+			entry.length = 0x100000000ULL - entry.base_addr;
+
+		for (piece = 0; piece < MM_ZONES; piece++)
+			if (piece_start(entry, piece) < piece_end(entry, piece))
+				metadata_size += mm_buddy_metadata_size(piece_start(entry, piece), piece_end(entry, piece)) +
+					database_size(piece_start(entry, piece), piece_end(entry, piece));
+	}
+
+	/* The bitmaps go right after the kernel, and the first free frame right after them */
+	metadata = (uint32_t *)&_end;
+	metadata_end = ((uint32_t)&_end + metadata_size + 0xFFF) & 0xFFFFF000;
+
+	/* Everything must fit in the identity mapped area */
+	if (metadata_end > MM_AREA_IDENTITY_END)
+		kernel_panic("The physical memory maps do not fit below 8MB (%u bytes)", metadata_size);
+
+	/* Now give available RAM to the buddy allocators (that is, memory > (0x100000 + kernel size)) */
+	for (piece = 0; piece < MM_ZONES; piece++) {
+		ppage_zone[piece].first_extent = ppage_extents;
+
+		for (i = 0; i < mmap_entries; i++) {
+		uint32_t cur_start, cur_end;
+
+			if (!usable(entry))
 				continue;
+
+			cur_start = piece_start(entry, piece);
+			cur_end = piece_end(entry, piece);
+			if (cur_start >= cur_end)
+				continue;
+
+			if (ppage_extents == PPAGE_MAX_EXTENTS) {
+				console_write("Too many physical memory ranges, ignoring the others.\n");
+				break;
 			}
 
-		}
+			metadata = mm_buddy_init(&ppage_extent[ppage_extents], cur_start, cur_end, metadata);
+
+			ppage_database[ppage_extents] = (struct mm_page *)metadata;
+			memory_clear(metadata, ppage_extent[ppage_extents].frames * sizeof(struct mm_page));
+			metadata += (ppage_extent[ppage_extents].frames * sizeof(struct mm_page) + 3) / sizeof(uint32_t);
+
+			ppage_extents++;
+			ppage_zone[piece].extents++;
 
-		{
-			unsigned int cur_start = (entry.base_addr + 0xFFF) & 0xFFFFF000;
-			unsigned int cur_length = entry.length >> 12;
+			if (entry.type != typeAvailable)
+				continue;
 
-			while (cur_length--) {
-				*ppage_stack_ptr++ = cur_start;
-				total_pages++;
-				cur_start += 0x1000;
+			/* If the area spans the kernel, remove the used area. The kernel frames are pinned for good */
+			for (; (cur_start < (metadata_end >> 12)) && (cur_start < cur_end); cur_start++) {
+				ppage_page_allocated(cur_start << 12);
+				mm_page_set_flags(cur_start << 12, MM_PAGE_FLAG_PINNED);
 			}
+
+			if (cur_start >= cur_end)
+				continue;
+
+			mm_buddy_add(&ppage_extent[ppage_extents - 1], cur_start, cur_end - cur_start);
+			ppage_zone[piece].total_frames += cur_end - cur_start;
+			total_pages += cur_end - cur_start;
 		}
-	}
 
-	/* Push the dummy page directory placeholder. More info about its use at x86.asm */
-	*ppage_stack_ptr++ = (uint32_t)&_dummy_page_directory;
-	total_pages++;
+		/* Keep 1/16 of the zone, but no more than 1MB, away from other zones */
+		ppage_zone[piece].watermark = min(ppage_zone[piece].total_frames / 16, 256);
+	}
 
 	free_pages = total_pages;
 
-	*kernel_end = (uint32_t)ppage_stack_ptr;
+	*kernel_end = metadata_end;
 		
 	return 0;
 }
 
 err_t mm_ppage_init_size(uint32_t *kernel_end)
 {
-	console_write("Physical page stack initializiation with the BIOS memory size is not implemented.\n");
+	console_write("Physical page allocator initializiation with the BIOS memory size is not implemented.\n");
 
 	return ERROR_NOT_IMPLEMENTED;
 }
@@ -154,10 +670,10 @@ err_t mm_ppage_init_size(uint32_t *kernel_end)
 err_t mm_ppage_init(uint32_t *kernel_end)
 {
 	/* 
-	 * The physical page stack is put at the end of the kernel and we put
+	 * The buddy allocator bitmaps are put at the end of the kernel and we put
 	 * in the kernel end pointer the new pointer to the end of the kernel,
-	 * that is, at the end of the (kernel + ppage stack) area.
-	 * To know the size of the page stack, we must calculate the available pages
+	 * that is, at the end of the (kernel + bitmaps) area.
+	 * To know the size of the bitmaps, we must calculate the available pages
 	 * given by the BIOS memory map or, as a last resort, by the BIOS-given memory
 	 * size.
 	 */
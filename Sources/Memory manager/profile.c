@@ -0,0 +1,282 @@
+/*
+ * Memory manager/profile.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Heap allocation profiler.
+ *
+ * When the kernel is built with HEAP_PROFILE, one heap allocation out of
+ * mm_heap_profile_rate is sampled and charged to its call site, which is the
+ * return address of mm_heap_allocate and friends. Every site counts the
+ * bytes and blocks it still holds, the allocations it made and their sizes.
+ * Sampled blocks are remembered in a hash table, so that freeing one gives
+ * its bytes back to its site. The numbers only count sampled allocations;
+ * multiply them by the rate to estimate the real totals.
+ *
+ * Nothing here uses the heap, so the tables have a fixed size. When the site
+ * table is full, new sites are charged to the overflow site (caller 0). When
+ * the block table is full, allocations are not sampled. The dump prints the
+ * sites as addresses, which can be looked up in symbols.txt.
+ */
+
+#include <mm.h>
+#include <cpu.h>
+#include <lock.h>
+#include <memory.h>
+#include <console.h>
+#include <interrupt.h>
+
+#ifdef MM_HEAP_PROFILE
+
+struct profile_block {
+	void		*block;		/* 0 if the slot is free */
+	size_t		bytes;
+	unsigned int	site;
+};
+
+/* Site 0 is the overflow one */
+static struct mm_heap_site profile_site[MM_HEAP_PROFILE_SITES];
+static unsigned int profile_sites = 1;
+
+/* Open addressing with linear probing */
+static struct profile_block profile_block[MM_HEAP_PROFILE_BLOCKS];
+static unsigned int profile_blocks;
+
+static unsigned int profile_countdown;
+static unsigned int profile_dropped;	/* Samples lost because the block table was full */
+
+static spinlock_t profile_lock = SPINLOCK_INITIALIZER;
+
+/* Allocations per sample, 0 stops sampling. It can be tuned at runtime */
+unsigned int mm_heap_profile_rate = MM_HEAP_PROFILE_RATE;
+
+#define profile_hash(block)	((((uint32_t)(block) >> 3) * 2654435761u >> 16) & (MM_HEAP_PROFILE_BLOCKS - 1))
+#define profile_next(slot)	(((slot) + 1) & (MM_HEAP_PROFILE_BLOCKS - 1))
+
+static uint32_t profile_lock_acquire(void)
+{
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+	lock_acquire(&profile_lock);
+
+	return eflags;
+}
+
+static void profile_lock_release(uint32_t eflags)
+{
+	lock_release(&profile_lock);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/* Histogram bucket: up to 16 bytes, then each bucket four times bigger than the previous one */
+static unsigned int profile_bucket(size_t bytes)
+{
+unsigned int bucket = 0;
+size_t limit = 16;
+
+	while ((bytes > limit) && (bucket < MM_HEAP_PROFILE_BUCKETS - 1)) {
+		limit <<= 2;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+static unsigned int profile_site_find(uint32_t caller)
+{
+unsigned int site;
+
+	for (site = 1; site < profile_sites; site++)
+		if (profile_site[site].caller == caller)
+			return site;
+
+	if (profile_sites == MM_HEAP_PROFILE_SITES)
+		return 0;
+
+	profile_site[site].caller = caller;
+	profile_sites++;
+
+	return site;
+}
+
+/* Slot of a sampled block, or MM_HEAP_PROFILE_BLOCKS */
+static unsigned int profile_block_find(void *block)
+{
+unsigned int slot;
+
+	for (slot = profile_hash(block); profile_block[slot].block; slot = profile_next(slot))
+		if (profile_block[slot].block == block)
+			return slot;
+
+	return MM_HEAP_PROFILE_BLOCKS;
+}
+
+/* Empty a slot, moving back the blocks after it so that no lookup stops early */
+static void profile_block_remove(unsigned int slot)
+{
+unsigned int next, home;
+
+	profile_block[slot].block = 0;
+
+	for (next = profile_next(slot); profile_block[next].block; next = profile_next(next)) {
+		home = profile_hash(profile_block[next].block);
+
+		/* Leave it if its home is after the hole, up to where it is now */
+		if ((slot < next) ? ((slot < home) && (home <= next)) : ((slot < home) || (home <= next)))
+			continue;
+
+		profile_block[slot] = profile_block[next];
+		profile_block[next].block = 0;
+		slot = next;
+	}
+
+	profile_blocks--;
+}
+
+/**************
+ * Heap hooks *
+ **************/
+
+/* Called by the heap for every block it hands out */
+void mm_heap_profile_allocate(void *block, size_t bytes, void *caller)
+{
+struct mm_heap_site *site;
+unsigned int slot, index;
+uint32_t eflags;
+
+	if (!block || !mm_heap_profile_rate)
+		return;
+
+	eflags = profile_lock_acquire();
+
+	if (profile_countdown) {
+		profile_countdown--;
+		goto out;
+	}
+
+	profile_countdown = mm_heap_profile_rate - 1;
+
+	/* Keep the table sparse, or the probes get long */
+	if (profile_blocks >= MM_HEAP_PROFILE_BLOCKS / 4 * 3) {
+		profile_dropped++;
+		goto out;
+	}
+
+	index = profile_site_find((uint32_t)caller);
+	site = &profile_site[index];
+
+	site->live_bytes += bytes;
+	site->live_blocks++;
+	site->allocations++;
+	site->histogram[profile_bucket(bytes)]++;
+
+	for (slot = profile_hash(block); profile_block[slot].block; slot = profile_next(slot))
+		;
+
+	profile_block[slot].block = block;
+	profile_block[slot].bytes = bytes;
+	profile_block[slot].site = index;
+	profile_blocks++;
+
+out:
+	profile_lock_release(eflags);
+}
+
+/* Called by the heap for every block given back */
+void mm_heap_profile_free(void *block)
+{
+struct profile_block *sample;
+unsigned int slot;
+uint32_t eflags;
+
+	/* Nobody else can be sampling this block, so a quick look is enough */
+	if (!block || !profile_blocks)
+		return;
+
+	eflags = profile_lock_acquire();
+
+	slot = profile_block_find(block);
+	if (slot != MM_HEAP_PROFILE_BLOCKS) {
+		sample = &profile_block[slot];
+
+		profile_site[sample->site].live_bytes -= sample->bytes;
+		profile_site[sample->site].live_blocks--;
+
+		profile_block_remove(slot);
+	}
+
+	profile_lock_release(eflags);
+}
+
+/********************
+ * Statistics, dump *
+ ********************/
+
+/* Copy up to count sites which made allocations. Returns how many were copied */
+unsigned int mm_heap_profile_get(struct mm_heap_site *sites, unsigned int count)
+{
+unsigned int site, copied = 0;
+uint32_t eflags;
+
+	eflags = profile_lock_acquire();
+
+	for (site = 0; (site < profile_sites) && (copied < count); site++)
+		if (profile_site[site].allocations)
+			sites[copied++] = profile_site[site];
+
+	profile_lock_release(eflags);
+
+	return copied;
+}
+
+/* Forget every site and sampled block */
+void mm_heap_profile_reset(void)
+{
+uint32_t eflags;
+
+	eflags = profile_lock_acquire();
+
+	memory_clear(profile_site, sizeof(profile_site));
+	memory_clear(profile_block, sizeof(profile_block));
+	profile_sites = 1;
+	profile_blocks = 0;
+	profile_countdown = 0;
+	profile_dropped = 0;
+
+	profile_lock_release(eflags);
+}
+
+void mm_heap_profile_dump(void)
+{
+static struct mm_heap_site sites[MM_HEAP_PROFILE_SITES];
+unsigned int count, i, j;
+
+	/* Print a copy, so the lock is not held while writing */
+	count = mm_heap_profile_get(sites, MM_HEAP_PROFILE_SITES);
+
+	console_write_formatted("Heap profile: 1 allocation out of %u sampled, %u samples lost\n", mm_heap_profile_rate, profile_dropped);
+	console_write_formatted("Caller   Live bytes Blocks Allocs   16   64  256   1K   4K  16K  64K more\n");
+
+	for (i = 0; i < count; i++) {
+		console_write_formatted("%.8X %10u %6u %6u", sites[i].caller, sites[i].live_bytes, sites[i].live_blocks,
+			sites[i].allocations);
+
+		for (j = 0; j < MM_HEAP_PROFILE_BUCKETS; j++)
+			console_write_formatted(" %4u", sites[i].histogram[j]);
+
+		console_write_formatted("\n");
+	}
+}
+
+#endif /* defined MM_HEAP_PROFILE */
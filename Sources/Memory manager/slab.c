@@ -0,0 +1,256 @@
+/*
+ * Memory manager/slab.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Slab allocator for fixed size objects.
+ *
+ * Every cache hands out objects of a single size, carved out of slabs: blocks
+ * of a power of two pages taken from the heap and aligned to their size, so
+ * the slab of an object is found by masking its address. The slab header is
+ * at the start of the block, and the free objects are linked through their
+ * first word.
+ *
+ * The slabs of a cache are kept in three lists. Partial slabs are used first,
+ * then empty ones, and only then a new slab is made. A few empty slabs are
+ * kept for the next allocations, the others go back to the heap. The objects
+ * of each new slab start one cache line further than the previous one
+ * (colouring), so the same objects of different slabs do not all compete for
+ * the same cache sets.
+ *
+ * The constructor, if any, is called on every object when its slab is made,
+ * so freed objects must be given back in their constructed state.
+ */
+
+#include <mm.h>
+#include <cpu.h>
+#include <kernel.h>
+#include <interrupt.h>
+
+struct mm_slab {
+	struct mm_slab_cache	*cache;
+	void			*free;		/* First free object, each one holds the next */
+	unsigned int		used;		/* Objects allocated */
+
+	struct mm_slab		*prev;
+	struct mm_slab		*next;
+};
+
+/* Objects start after the header, on a cache line */
+#define SLAB_HEADER_SIZE	((sizeof(struct mm_slab) + MM_SLAB_LINE - 1) & ~(MM_SLAB_LINE - 1))
+
+static void slab_list_insert(struct mm_slab **list, struct mm_slab *slab)
+{
+	slab->prev = 0;
+	slab->next = *list;
+	if (*list)
+		(*list)->prev = slab;
+
+	*list = slab;
+}
+
+static void slab_list_remove(struct mm_slab **list, struct mm_slab *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		*list = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+static struct mm_slab *slab_create(struct mm_slab_cache *cache)
+{
+struct mm_slab *slab;
+unsigned char *object;
+unsigned int i;
+
+	slab = (struct mm_slab *)mm_heap_allocate_aligned(cache->slab_size, cache->slab_size);
+	if (!slab)
+		return 0;
+
+	slab->cache = cache;
+	slab->used = 0;
+	slab->free = 0;
+
+	object = (unsigned char *)slab + SLAB_HEADER_SIZE + cache->colour;
+
+	/* Next colour, wrapping around when the space left in the slab is over */
+	cache->colour += MM_SLAB_LINE;
+	if (cache->colour > cache->colour_max)
+		cache->colour = 0;
+
+	/* Link the objects backwards, so they are handed out in address order */
+	object += (cache->objects - 1) * cache->size;
+	for (i = 0; i < cache->objects; i++) {
+		if (cache->constructor)
+			cache->constructor(object);
+
+		*(void **)object = slab->free;
+		slab->free = object;
+		object -= cache->size;
+	}
+
+	cache->slabs++;
+
+	return slab;
+}
+
+static void slab_destroy(struct mm_slab_cache *cache, struct mm_slab *slab)
+{
+	mm_heap_free(slab);
+	cache->slabs--;
+}
+
+/**************************
+ * Allocation and freeing *
+ **************************/
+
+void *mm_slab_allocate(struct mm_slab_cache *cache)
+{
+struct mm_slab *slab;
+void *object;
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	slab = cache->partial;
+	if (!slab) {
+		slab = cache->empty;
+		if (slab) {
+			slab_list_remove(&cache->empty, slab);
+			cache->empty_count--;
+		} else
+			slab = slab_create(cache);
+
+		if (!slab) {
+			if (eflags & CPU_FLAG_INTERRUPT)
+				interrupt_enable();
+
+			return 0;
+		}
+
+		slab_list_insert(&cache->partial, slab);
+	}
+
+	object = slab->free;
+	slab->free = *(void **)object;
+	slab->used++;
+	cache->allocated++;
+
+	if (slab->used == cache->objects) {
+		slab_list_remove(&cache->partial, slab);
+		slab_list_insert(&cache->full, slab);
+	}
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return object;
+}
+
+void mm_slab_free(struct mm_slab_cache *cache, void *object)
+{
+struct mm_slab *slab;
+uint32_t eflags;
+
+	if (!object)
+		return;
+
+	slab = (struct mm_slab *)((uint32_t)object & ~(cache->slab_size - 1));
+	if (slab->cache != cache)
+		kernel_bug("Freeing an object of the %s cache to the %s cache", slab->cache->name, cache->name);
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	if (slab->used == cache->objects) {
+		slab_list_remove(&cache->full, slab);
+		slab_list_insert(&cache->partial, slab);
+	}
+
+	*(void **)object = slab->free;
+	slab->free = object;
+	slab->used--;
+	cache->allocated--;
+
+	if (!slab->used) {
+		slab_list_remove(&cache->partial, slab);
+
+		if (cache->empty_count < MM_SLAB_EMPTY_MAX) {
+			slab_list_insert(&cache->empty, slab);
+			cache->empty_count++;
+		} else
+			slab_destroy(cache, slab);
+	}
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/* Give every empty slab back to the heap */
+void mm_slab_shrink(struct mm_slab_cache *cache)
+{
+struct mm_slab *slab;
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	while ((slab = cache->empty)) {
+		slab_list_remove(&cache->empty, slab);
+		slab_destroy(cache, slab);
+	}
+
+	cache->empty_count = 0;
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/******************
+ * Initialization *
+ ******************/
+
+/*
+ * Set up an empty cache of objects of the given size. Slabs are made big
+ * enough to hold at least MM_SLAB_MIN_OBJECTS objects, up to MM_SLAB_MAX_PAGES.
+ */
+err_t mm_slab_cache_init(struct mm_slab_cache *cache, unsigned char *name, size_t size, void (*constructor)(void *object))
+{
+unsigned int pages = 1;
+
+	/* Objects hold the free list link when free, and are kept aligned */
+	size = (max(size, sizeof(void *)) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+
+	while (((pages * CPU_PAGE_SIZE - SLAB_HEADER_SIZE) / size < MM_SLAB_MIN_OBJECTS) && (pages < MM_SLAB_MAX_PAGES))
+		pages <<= 1;
+
+	if ((pages * CPU_PAGE_SIZE - SLAB_HEADER_SIZE) < size)
+		return ERROR_INVALID;
+
+	cache->name = name;
+	cache->size = size;
+	cache->slab_size = pages * CPU_PAGE_SIZE;
+	cache->objects = (cache->slab_size - SLAB_HEADER_SIZE) / size;
+	cache->constructor = constructor;
+
+	cache->colour = 0;
+	cache->colour_max = (cache->slab_size - SLAB_HEADER_SIZE - cache->objects * size) & ~(MM_SLAB_LINE - 1);
+
+	cache->partial = cache->full = cache->empty = 0;
+	cache->empty_count = 0;
+
+	cache->allocated = 0;
+	cache->slabs = 0;
+
+	return 0;
+}
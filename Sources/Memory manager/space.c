@@ -0,0 +1,166 @@
+/*
+ * Memory manager/space.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+#include <mm.h>
+#include <cpu.h>
+#include <memory.h>
+#include <kernel.h>
+#include <interrupt.h>
+
+/* From x86.asm */
+extern uint32_t _process_page_directory[1024];
+
+/*
+ * Create an empty address space, sharing the kernel area and with its own
+ * self map. The physical address of the page directory is put in page_directory.
+ */
+err_t mm_space_create(uint32_t *page_directory)
+{
+uint32_t *directory;
+uint32_t eflags;
+
+	return_on_failure(mm_page_table_allocate(page_directory));
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	directory = mm_kmap(MM_KMAP_DIRECTORY, *page_directory);
+	memory_copy(directory, _process_page_directory, (MM_AREA_KERNEL_END >> 22) * sizeof(uint32_t));
+	directory[MM_AREA_PAGE_TABLES >> 22] = *page_directory | CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_PRESENT;
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return 0;
+}
+
+/*
+ * Duplicate the current address space. The kernel area is shared as usual,
+ * while the user pages are shared read-only by both spaces and marked with
+ * MM_PAGE_COW, so the first write to any of them makes a private copy (see
+ * mm_map_fault). Only the user page tables are copied here.
+ * The physical address of the new page directory is put in page_directory.
+ */
+err_t mm_space_clone(uint32_t *page_directory)
+{
+struct mm_tlb_gather tlb;
+uint32_t *parent = (uint32_t *)MM_PAGE_DIRECTORY;
+uint32_t *child, *parent_table, *child_table;
+uint32_t table, entry, eflags;
+unsigned int i, j, tables = 0;
+err_t error = 0;
+
+	/* A page directory and a copy of every user page table are needed */
+	for (i = MM_AREA_USER_START >> 22; i < 1024; i++)
+		if (parent[i] & CPU_PAGE_FLAG_PRESENT)
+			tables++;
+
+	if (mm_ppage_get_free() < tables + 1)
+		return ERROR_NO_MEMORY;
+
+	return_on_failure(mm_space_create(page_directory));
+
+	/* The temporary slots are ours until interrupts are enabled again */
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	child = mm_kmap(MM_KMAP_DIRECTORY, *page_directory);
+	mm_tlb_gather_init(&tlb);
+
+	for (i = MM_AREA_USER_START >> 22; i < 1024 && !error; i++) {
+		if (!(parent[i] & CPU_PAGE_FLAG_PRESENT))
+			continue;
+
+		if ((error = mm_page_table_allocate(&table)))
+			break;
+
+		child[i] = table | (parent[i] & 0xFFF);
+
+		parent_table = (uint32_t *)(MM_AREA_PAGE_TABLES + (i << 12));
+		child_table = mm_kmap(MM_KMAP_TABLE, table);
+
+		for (j = 0; j < 1024; j++) {
+			entry = parent_table[j];
+
+			/* Frames we do not manage (such as device memory) are simply shared */
+			if ((entry & CPU_PAGE_FLAG_PRESENT) && mm_page_get(entry & 0xFFFFF000)) {
+				/* A frame shared too many times stops the copy here, the child gets destroyed below */
+				if ((error = mm_page_reference(entry & 0xFFFFF000)))
+					break;
+
+				if (entry & CPU_PAGE_FLAG_WRITABLE) {
+					entry = (entry & ~CPU_PAGE_FLAG_WRITABLE) | MM_PAGE_COW;
+					parent_table[j] = entry;
+					mm_tlb_gather_add(&tlb, (i << 10) | j, 1);
+				}
+			}
+
+			/* Reserved entries are copied too, and each space gets its own frame */
+			child_table[j] = entry;
+		}
+	}
+
+	/* The parent has lost write access to its pages, on every processor running its threads */
+	mm_tlb_gather_flush(&tlb);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	if (error)
+		mm_space_destroy(*page_directory);
+
+	return error;
+}
+
+/*
+ * Give back an address space which no processor is using. Each user page
+ * table is walked once, the frames it maps are released in a single batch,
+ * and the table goes back to the page table cache already cleared.
+ */
+void mm_space_destroy(uint32_t page_directory)
+{
+uint32_t *directory, *table;
+uint32_t entry, frame, eflags;
+unsigned int i, j, count;
+
+	for (i = MM_AREA_USER_START >> 22; i < 1024; i++) {
+		/* The temporary slots are ours until interrupts are enabled again, so a table is done at once */
+		eflags = cpu_flags_get();
+		interrupt_disable();
+
+		directory = mm_kmap(MM_KMAP_DIRECTORY, page_directory);
+		entry = directory[i];
+		directory[i] = 0;
+
+		if (entry & CPU_PAGE_FLAG_PRESENT) {
+			table = mm_kmap(MM_KMAP_TABLE, entry & 0xFFFFF000);
+
+			/* Pack the mapped frames at the start of the table, clearing every other entry */
+			for (j = 0, count = 0; j < 1024; j++) {
+				frame = table[j];
+				table[j] = 0;
+
+				if (frame & CPU_PAGE_FLAG_PRESENT)
+					table[count++] = frame & 0xFFFFF000;
+			}
+
+			mm_page_release_array(table, count);
+			memory_clear(table, count * sizeof(uint32_t));
+
+			mm_page_table_free(entry & 0xFFFFF000);
+		}
+
+		if (eflags & CPU_FLAG_INTERRUPT)
+			interrupt_enable();
+	}
+
+	mm_page_release(page_directory);
+}
@@ -0,0 +1,80 @@
+/*
+ * Memory manager/tlb.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * TLB invalidation batching.
+ *
+ * The map and unmap functions add the pages they change to a gather, which
+ * is flushed once when the whole operation is done. A few pages are
+ * invalidated one by one with invlpg; past mm_tlb_flush_threshold pages it
+ * is cheaper to reload CR3 and let the TLB refill. A CR3 reload keeps global
+ * entries, so if kernel pages were changed the global pages are flushed too.
+ *
+ * The other processors may have the same pages in their TLBs, so a gather is
+ * flushed on all of them (see smp_tlb_shootdown).
+ */
+
+#include <mm.h>
+#include <cpu.h>
+#include <smp.h>
+
+/* Pages above which the whole TLB is flushed. It can be tuned at runtime */
+unsigned int mm_tlb_flush_threshold = MM_TLB_FLUSH_THRESHOLD;
+
+void mm_tlb_gather_init(struct mm_tlb_gather *tlb)
+{
+	tlb->start = 0;
+	tlb->end = 0;
+	tlb->global = 0;
+}
+
+/* Add a range of pages to invalidate. The gather keeps a single range covering all of them */
+void mm_tlb_gather_add(struct mm_tlb_gather *tlb, uint32_t start, uint32_t length)
+{
+	if (!length)
+		return;
+
+	if (tlb->start == tlb->end) {
+		tlb->start = start;
+		tlb->end = start + length;
+	} else {
+		tlb->start = min(tlb->start, start);
+		tlb->end = max(tlb->end, start + length);
+	}
+
+	/* Only the kernel area has global pages */
+	if (start < (MM_AREA_KERNEL_END >> 12))
+		tlb->global = 1;
+}
+
+/* Invalidate the pages of a gather on this processor only */
+void mm_tlb_flush_local(struct mm_tlb_gather *tlb)
+{
+	if (tlb->start == tlb->end)
+		return;
+
+	if (tlb->end - tlb->start <= mm_tlb_flush_threshold)
+		cpu_mmu_invalidate(tlb->start, tlb->end - tlb->start);
+	else if (tlb->global && (_cpu.capabilities & CPU_CAPABILITY_GLOBALPAGES))
+		cpu_mmu_flush_global();
+	else
+		cpu_mmu_flush();
+}
+
+void mm_tlb_gather_flush(struct mm_tlb_gather *tlb)
+{
+	if (tlb->start == tlb->end)
+		return;
+
+	smp_tlb_shootdown(tlb);
+
+	mm_tlb_gather_init(tlb);
+}
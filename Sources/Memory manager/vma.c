@@ -0,0 +1,395 @@
+/*
+ * Memory manager/vma.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Virtual memory areas.
+ *
+ * Every process describes its user address space with a set of areas, each
+ * with its protection, backing kind and grow direction. The areas never
+ * overlap and are kept in an AVL tree ordered by their first page, so the
+ * page fault handler, map and unmap find the area of an address in O(log n).
+ * Pages in an area are only backed when they are first touched.
+ */
+
+#include <mm.h>
+#include <cpu.h>
+#include <memory.h>
+#include <kernel.h>
+
+/************
+ * AVL tree *
+ ************/
+
+#define vma_height(vma)		((vma) ? (vma)->height : 0)
+
+static inline void vma_update(struct mm_vma *vma)
+{
+	vma->height = max(vma_height(vma->left), vma_height(vma->right)) + 1;
+}
+
+static struct mm_vma *vma_rotate_right(struct mm_vma *vma)
+{
+struct mm_vma *left = vma->left;
+
+	vma->left = left->right;
+	left->right = vma;
+
+	vma_update(vma);
+	vma_update(left);
+
+	return left;
+}
+
+static struct mm_vma *vma_rotate_left(struct mm_vma *vma)
+{
+struct mm_vma *right = vma->right;
+
+	vma->right = right->left;
+	right->left = vma;
+
+	vma_update(vma);
+	vma_update(right);
+
+	return right;
+}
+
+static struct mm_vma *vma_balance(struct mm_vma *vma)
+{
+int balance;
+
+	vma_update(vma);
+	balance = vma_height(vma->left) - vma_height(vma->right);
+
+	if (balance > 1) {
+		if (vma_height(vma->left->left) < vma_height(vma->left->right))
+			vma->left = vma_rotate_left(vma->left);
+
+		return vma_rotate_right(vma);
+	}
+
+	if (balance < -1) {
+		if (vma_height(vma->right->right) < vma_height(vma->right->left))
+			vma->right = vma_rotate_right(vma->right);
+
+		return vma_rotate_left(vma);
+	}
+
+	return vma;
+}
+
+static struct mm_vma *vma_insert(struct mm_vma *root, struct mm_vma *vma)
+{
+	if (!root)
+		return vma;
+
+	if (vma->start < root->start)
+		root->left = vma_insert(root->left, vma);
+	else
+		root->right = vma_insert(root->right, vma);
+
+	return vma_balance(root);
+}
+
+static struct mm_vma *vma_remove_first(struct mm_vma *root, struct mm_vma **first)
+{
+	if (!root->left) {
+		*first = root;
+		return root->right;
+	}
+
+	root->left = vma_remove_first(root->left, first);
+
+	return vma_balance(root);
+}
+
+static struct mm_vma *vma_remove(struct mm_vma *root, struct mm_vma *vma)
+{
+struct mm_vma *successor;
+
+	if (!root)
+		return 0;
+
+	if (vma->start < root->start)
+		root->left = vma_remove(root->left, vma);
+	else if (vma->start > root->start)
+		root->right = vma_remove(root->right, vma);
+	else {
+		if (!root->right)
+			return root->left;
+
+		root->right = vma_remove_first(root->right, &successor);
+		successor->left = root->left;
+		successor->right = root->right;
+		root = successor;
+	}
+
+	return vma_balance(root);
+}
+
+/* First area ending after the page. Areas do not overlap, so they are sorted by their end too */
+static struct mm_vma *vma_find_next(struct mm_vma *root, uint32_t page)
+{
+struct mm_vma *found = 0;
+
+	while (root) {
+		if (page < root->end) {
+			found = root;
+			root = root->left;
+		} else
+			root = root->right;
+	}
+
+	return found;
+}
+
+/* Last area starting at or before the page */
+static struct mm_vma *vma_find_previous(struct mm_vma *root, uint32_t page)
+{
+struct mm_vma *found = 0;
+
+	while (root) {
+		if (root->start <= page) {
+			found = root;
+			root = root->right;
+		} else
+			root = root->left;
+	}
+
+	return found;
+}
+
+/* Area containing the page, or 0 */
+struct mm_vma *mm_vma_find(struct mm_vma *root, uint32_t page)
+{
+struct mm_vma *vma;
+
+	vma = vma_find_next(root, page);
+	if (vma && (vma->start <= page))
+		return vma;
+
+	return 0;
+}
+
+/* Split an area in two at the given page, which becomes the start of the new upper area */
+static err_t vma_split(struct mm_vma **root, struct mm_vma *vma, uint32_t page)
+{
+struct mm_vma *upper;
+
+	if ((page <= vma->start) || (page >= vma->end))
+		return 0;
+
+	upper = (struct mm_vma *)mm_heap_allocate(sizeof(struct mm_vma));
+	if (!upper)
+		return ERROR_NO_MEMORY;
+
+	memory_copy(upper, vma, sizeof(struct mm_vma));
+	upper->start = page;
+	upper->offset += (page - vma->start) << 12;
+	upper->left = upper->right = 0;
+	upper->height = 1;
+
+	/* Only the outer end of a growable area can grow */
+	if (vma->flags & MM_VMA_GROWS_DOWN)
+		upper->flags &= ~MM_VMA_GROWS_DOWN;
+	else
+		vma->flags &= ~MM_VMA_GROWS_UP;
+
+	vma->end = page;
+	*root = vma_insert(*root, upper);
+
+	return 0;
+}
+
+/* Make area boundaries fall at start and end, so the range is made of whole areas */
+static err_t vma_split_range(struct mm_vma **root, uint32_t start, uint32_t end)
+{
+struct mm_vma *vma;
+
+	vma = mm_vma_find(*root, start);
+	if (vma)
+		return_on_failure(vma_split(root, vma, start));
+
+	vma = mm_vma_find(*root, end);
+	if (vma)
+		return_on_failure(vma_split(root, vma, end));
+
+	return 0;
+}
+
+static unsigned int vma_page_flags(struct mm_vma *vma)
+{
+	return CPU_PAGE_FLAG_USER | ((vma->protection & MM_VMA_WRITE) ? CPU_PAGE_FLAG_WRITABLE : 0);
+}
+
+/***********************
+ * Map, unmap, protect *
+ ***********************/
+
+/*
+ * Create an area. Nothing is mapped until it is touched. If vma is not null,
+ * the new area is put there, so the caller can set the backing object.
+ */
+err_t mm_vma_map(struct mm_vma **root, uint32_t start, uint32_t length, unsigned int protection, unsigned int kind,
+	unsigned int flags, struct mm_vma **vma)
+{
+struct mm_vma *new, *next;
+
+	if (!length || (start < (MM_AREA_USER_START >> 12)) || (start + length > (MM_AREA_USER_END >> 12) + 1) ||
+		(kind >= MM_VMA_KINDS) || ((flags & MM_VMA_GROWS_DOWN) && (flags & MM_VMA_GROWS_UP)))
+		return ERROR_INVALID;
+
+	next = vma_find_next(*root, start);
+	if (next && (next->start < start + length))
+		return ERROR_USED;
+
+	new = (struct mm_vma *)mm_heap_allocate(sizeof(struct mm_vma));
+	if (!new)
+		return ERROR_NO_MEMORY;
+	memory_clear(new, sizeof(struct mm_vma));
+
+	new->start = start;
+	new->end = start + length;
+	new->protection = protection;
+	new->kind = kind;
+	new->flags = flags;
+	new->height = 1;
+
+	/* Growable areas can grow up to MM_VMA_GROW_PAGES */
+	if (flags & MM_VMA_GROWS_DOWN)
+		new->limit = (new->end > MM_VMA_GROW_PAGES) ? max(new->end - MM_VMA_GROW_PAGES, MM_AREA_USER_START >> 12) : start;
+	else if (flags & MM_VMA_GROWS_UP)
+		new->limit = min(start + MM_VMA_GROW_PAGES, (MM_AREA_USER_END >> 12) + 1);
+
+	*root = vma_insert(*root, new);
+
+	if (vma)
+		*vma = new;
+
+	return 0;
+}
+
+/* Remove a range from the areas, giving back the pages which were backed */
+err_t mm_vma_unmap(struct mm_vma **root, uint32_t start, uint32_t length)
+{
+struct mm_tlb_gather tlb;
+struct mm_vma *vma;
+
+	return_on_failure(vma_split_range(root, start, start + length));
+
+	mm_tlb_gather_init(&tlb);
+
+	while ((vma = vma_find_next(*root, start)) && (vma->start < start + length)) {
+		mm_unmap_gather(&tlb, vma->start, vma->end - vma->start);
+
+		*root = vma_remove(*root, vma);
+		mm_heap_free(vma);
+	}
+
+	mm_tlb_gather_flush(&tlb);
+
+	return 0;
+}
+
+/* Change the protection of a range, which must be covered by areas */
+err_t mm_vma_protect(struct mm_vma **root, uint32_t start, uint32_t length, unsigned int protection)
+{
+struct mm_vma *vma;
+uint32_t page;
+
+	/* Check there are no holes first */
+	for (page = start; page < start + length; page = vma->end) {
+		vma = mm_vma_find(*root, page);
+		if (!vma)
+			return ERROR_NOT_FOUND;
+	}
+
+	return_on_failure(vma_split_range(root, start, start + length));
+
+	for (page = start; page < start + length; page = vma->end) {
+		vma = mm_vma_find(*root, page);
+		vma->protection = protection;
+
+		mm_protect(vma->start, vma->end - vma->start, vma_page_flags(vma));
+	}
+
+	return 0;
+}
+
+/*
+ * Resolve a page fault in the user area. The page is backed if it belongs to
+ * an area allowing the access, growing a stack if it is just beyond it.
+ */
+err_t mm_vma_fault(struct mm_vma **root, uint32_t address, uint32_t error_code)
+{
+struct mm_vma *vma, *other;
+uint32_t page = address >> 12;
+
+	vma = mm_vma_find(*root, page);
+
+	if (!vma) {
+		/* Maybe a growable area is just beyond the page */
+		vma = vma_find_next(*root, page);
+		other = vma_find_previous(*root, page);
+
+		if (vma && (vma->flags & MM_VMA_GROWS_DOWN) && (page >= vma->limit))
+			vma->start = page;
+		else if (other && (other->flags & MM_VMA_GROWS_UP) && (page < other->limit)) {
+			vma = other;
+			vma->end = page + 1;
+		} else
+			return ERROR_NOT_FOUND;
+	}
+
+	if ((error_code & CPU_PAGE_FAULT_PRESENT) || ((error_code & CPU_PAGE_FAULT_WRITE) && !(vma->protection & MM_VMA_WRITE)))
+		return ERROR_INVALID;
+
+	/* File and shared areas are populated by their creator, since a fault cannot wait for the disk */
+	if ((vma->kind != MM_VMA_ANONYMOUS) && (vma->kind != MM_VMA_STACK))
+		return ERROR_NOT_SUPPORTED;
+
+	return_on_failure(mm_reserve(page, 1, vma_page_flags(vma), MM_OWNER_USER));
+
+	return mm_map_commit(page, 1);
+}
+
+/* Copy the areas of a space, for the clone of an address space */
+err_t mm_vma_clone(struct mm_vma *root, struct mm_vma **copy)
+{
+	*copy = 0;
+
+	if (!root)
+		return 0;
+
+	*copy = (struct mm_vma *)mm_heap_allocate(sizeof(struct mm_vma));
+	if (!*copy)
+		return ERROR_NO_MEMORY;
+
+	memory_copy(*copy, root, sizeof(struct mm_vma));
+	(*copy)->left = (*copy)->right = 0;
+
+	return_on_failure(mm_vma_clone(root->left, &(*copy)->left));
+	return_on_failure(mm_vma_clone(root->right, &(*copy)->right));
+
+	return 0;
+}
+
+/* Free every area descriptor. The pages are left alone */
+void mm_vma_destroy(struct mm_vma **root)
+{
+	if (!*root)
+		return;
+
+	mm_vma_destroy(&(*root)->left);
+	mm_vma_destroy(&(*root)->right);
+
+	mm_heap_free(*root);
+	*root = 0;
+}
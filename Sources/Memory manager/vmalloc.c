@@ -0,0 +1,383 @@
+/*
+ * Memory manager/vmalloc.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Kernel virtual address allocator.
+ *
+ * The device window hands out virtually contiguous ranges, backed either by
+ * scattered frames (mm_vmalloc), by frames given on the first access
+ * (mm_vreserve) or by a device physical range (mm_ioremap), so big buffers
+ * and memory mapped registers stay out of the heap. Thread stacks come from
+ * an area of their own (mm_vstack), whose page tables exist in every space
+ * from boot: a processor may switch space while still on a stack, and a
+ * missing page table there could not be faulted in. Every range is
+ * followed by a guard page which is never mapped, so an overrun faults
+ * instead of hitting the next range. Since the range below ends with its own
+ * guard page, or is free, stacks are guarded when they underflow too.
+ *
+ * Freed ranges are unmapped at once, but they are only reused when
+ * MM_VM_PURGE_PAGES pages are waiting: then all of them are invalidated from
+ * the TLB with a single flush. Until then nobody can see the stale entries,
+ * since the addresses are not handed out.
+ */
+
+#include <mm.h>
+#include <cpu.h>
+#include <kernel.h>
+#include <interrupt.h>
+
+#define VM_RANGE_DEVICE		0x1	/* Maps device memory, whose frames are not ours */
+
+#define VM_AREA_DEVICES		0
+#define VM_AREA_STACKS		1
+#define VM_AREAS		2
+
+/* Area holding a page */
+#define vm_area(page)		(((page) < (MM_AREA_STACKS_END >> 12)) ? VM_AREA_STACKS : VM_AREA_DEVICES)
+
+struct vm_range {
+	uint32_t		start;		/* First page */
+	uint32_t		length;		/* Pages, the guard page included */
+	unsigned int		flags;
+
+	struct vm_range		*next;
+};
+
+/* Free ranges of each area sorted by address, ranges in use and freed ranges waiting for the TLB flush */
+static struct vm_range *vm_free_list[VM_AREAS], *vm_used_list, *vm_lazy_list;
+
+static struct mm_tlb_gather vm_lazy_tlb;
+static unsigned int vm_lazy_pages;
+
+/* Give a range back to the free list of its area, merging it with its neighbours */
+static void vm_free_insert(struct vm_range *range)
+{
+struct vm_range **list = &vm_free_list[vm_area(range->start)];
+struct vm_range *prev = 0, *next = *list;
+
+	while (next && (next->start < range->start)) {
+		prev = next;
+		next = next->next;
+	}
+
+	if (next && (range->start + range->length == next->start)) {
+		range->length += next->length;
+		range->next = next->next;
+		mm_heap_free(next);
+	} else
+		range->next = next;
+
+	if (prev && (prev->start + prev->length == range->start)) {
+		prev->length += range->length;
+		prev->next = range->next;
+		mm_heap_free(range);
+	} else if (prev)
+		prev->next = range;
+	else
+		*list = range;
+}
+
+/* Flush the TLB once for every freed range and make them available again. Interrupts must be disabled */
+static void vm_purge(void)
+{
+struct vm_range *range;
+
+	mm_tlb_gather_flush(&vm_lazy_tlb);
+
+	while ((range = vm_lazy_list)) {
+		vm_lazy_list = range->next;
+		vm_free_insert(range);
+	}
+
+	vm_lazy_pages = 0;
+}
+
+/* First fit in an area. The range is taken from the start of the free one */
+static err_t vm_reserve(unsigned int area, uint32_t length, unsigned int flags, struct vm_range **range)
+{
+struct vm_range *free, *prev;
+uint32_t eflags;
+int purged = 0;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	for (;;) {
+		for (prev = 0, free = vm_free_list[area]; free; prev = free, free = free->next)
+			if (free->length >= length)
+				break;
+
+		if (free || purged || !vm_lazy_list)
+			break;
+
+		/* The freed ranges may be enough */
+		vm_purge();
+		purged = 1;
+	}
+
+	if (!free)
+		goto error;
+
+	if (free->length == length) {
+		/* The whole free range is used */
+		if (prev)
+			prev->next = free->next;
+		else
+			vm_free_list[area] = free->next;
+
+		*range = free;
+	} else {
+		*range = (struct vm_range *)mm_heap_allocate(sizeof(struct vm_range));
+		if (!*range)
+			goto error;
+
+		(*range)->start = free->start;
+		free->start += length;
+		free->length -= length;
+	}
+
+	(*range)->length = length;
+	(*range)->flags = flags;
+	(*range)->next = vm_used_list;
+	vm_used_list = *range;
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return 0;
+
+error:
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return ERROR_NO_MEMORY;
+}
+
+/* Take a range out of the used list. Returns 0 if no range starts at the page */
+static struct vm_range *vm_find_remove(uint32_t page)
+{
+struct vm_range *range, *prev = 0;
+
+	for (range = vm_used_list; range; prev = range, range = range->next)
+		if (range->start == page)
+			break;
+
+	if (!range)
+		return 0;
+
+	if (prev)
+		prev->next = range->next;
+	else
+		vm_used_list = range->next;
+
+	return range;
+}
+
+/*******************
+ * Allocation, map *
+ *******************/
+
+/* Allocate a virtually contiguous buffer backed by any frame */
+err_t mm_vmalloc(size_t bytes, void **address)
+{
+struct vm_range *range;
+uint32_t pages;
+err_t ret;
+
+	*address = 0;
+
+	pages = size_in_pages(bytes);
+	if (!pages)
+		return ERROR_INVALID;
+
+	return_on_failure(vm_reserve(VM_AREA_DEVICES, pages + 1, 0, &range));
+
+	ret = mm_map_owned(range->start, pages, CPU_PAGE_FLAG_WRITABLE, MM_OWNER_KERNEL);
+	if (ret) {
+		/* What was mapped is unmapped, and the range waits with the freed ones */
+		mm_vfree((void *)(range->start << 12));
+		return ret;
+	}
+
+	*address = (void *)(range->start << 12);
+
+	return 0;
+}
+
+/*
+ * Reserve a virtually contiguous range without backing it. Every page gets a
+ * cleared frame on its first access, so the range can be much bigger than
+ * what is actually used. Thread stacks take mm_vstack instead.
+ */
+err_t mm_vreserve(size_t bytes, void **address)
+{
+struct vm_range *range;
+uint32_t pages;
+err_t ret;
+
+	*address = 0;
+
+	pages = size_in_pages(bytes);
+	if (!pages)
+		return ERROR_INVALID;
+
+	return_on_failure(vm_reserve(VM_AREA_DEVICES, pages + 1, 0, &range));
+
+	ret = mm_reserve(range->start, pages, CPU_PAGE_FLAG_WRITABLE, MM_OWNER_KERNEL);
+	if (ret) {
+		mm_vfree((void *)(range->start << 12));
+		return ret;
+	}
+
+	*address = (void *)(range->start << 12);
+
+	return 0;
+}
+
+/*
+ * Reserve a thread stack. Like mm_vreserve, every page gets a cleared frame
+ * on its first access: page faults are handled on a stack of their own (see
+ * interrupt_trap_page), so a ring 0 stack can grow this way too. Stacks
+ * overflow into the guard page of the range below, or the unused first page
+ * of the area.
+ */
+err_t mm_vstack(size_t bytes, void **address)
+{
+struct vm_range *range;
+uint32_t pages;
+err_t ret;
+
+	*address = 0;
+
+	pages = size_in_pages(bytes);
+	if (!pages)
+		return ERROR_INVALID;
+
+	return_on_failure(vm_reserve(VM_AREA_STACKS, pages + 1, 0, &range));
+
+	ret = mm_reserve(range->start, pages, CPU_PAGE_FLAG_WRITABLE, MM_OWNER_KERNEL);
+	if (ret) {
+		mm_vfree((void *)(range->start << 12));
+		return ret;
+	}
+
+	*address = (void *)(range->start << 12);
+
+	return 0;
+}
+
+/*
+ * Map a device physical range, such as registers or a frame buffer. Flags are
+ * page flags, usually CPU_PAGE_FLAG_WRITABLE and CPU_PAGE_FLAG_NOCACHE. The
+ * physical address does not need to be page aligned: the returned address
+ * keeps the same offset in the page.
+ */
+err_t mm_ioremap(uint32_t physical, size_t bytes, unsigned flags, void **address)
+{
+struct vm_range *range;
+uint32_t pages, offset;
+err_t ret;
+
+	*address = 0;
+
+	if (!bytes)
+		return ERROR_INVALID;
+
+	offset = physical & (CPU_PAGE_SIZE - 1);
+	pages = size_in_pages(offset + bytes);
+
+	return_on_failure(vm_reserve(VM_AREA_DEVICES, pages + 1, VM_RANGE_DEVICE, &range));
+
+	ret = mm_map_physical(range->start, physical >> 12, pages, flags);
+	if (ret) {
+		mm_vfree((void *)(range->start << 12));
+		return ret;
+	}
+
+	*address = (void *)((range->start << 12) + offset);
+
+	return 0;
+}
+
+/* Unmap a range allocated with mm_vmalloc, mm_vreserve, mm_vstack or mm_ioremap */
+void mm_vfree(void *address)
+{
+struct vm_range *range;
+uint32_t eflags, pages;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	range = vm_find_remove((uint32_t)address >> 12);
+	if (!range)
+		kernel_bug("Freeing an address which was not allocated");
+
+	/* The guard page was never mapped */
+	pages = range->length - 1;
+
+	if (range->flags & VM_RANGE_DEVICE)
+		mm_unmap_physical_gather(&vm_lazy_tlb, range->start, pages);
+	else
+		mm_unmap_gather(&vm_lazy_tlb, range->start, pages);
+
+	range->next = vm_lazy_list;
+	vm_lazy_list = range;
+	vm_lazy_pages += range->length;
+
+	if (vm_lazy_pages >= MM_VM_PURGE_PAGES)
+		vm_purge();
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/* Make every freed range available now */
+void mm_vm_purge(void)
+{
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	vm_purge();
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/******************
+ * Initialization *
+ ******************/
+
+err_t mm_vm_init(void)
+{
+/* The first stack page is never handed out, so the lowest stack has a guard page below it too */
+static const uint32_t area_start[VM_AREAS] = { MM_AREA_DEVICES_START, MM_AREA_STACKS_START + CPU_PAGE_SIZE };
+static const uint32_t area_end[VM_AREAS] = { MM_AREA_DEVICES_END, MM_AREA_STACKS_END };
+unsigned int area;
+
+	for (area = 0; area < VM_AREAS; area++) {
+		vm_free_list[area] = (struct vm_range *)mm_heap_allocate(sizeof(struct vm_range));
+		if (!vm_free_list[area])
+			return ERROR_NO_MEMORY;
+
+		vm_free_list[area]->start = area_start[area] >> 12;
+		vm_free_list[area]->length = (area_end[area] - area_start[area]) >> 12;
+		vm_free_list[area]->flags = 0;
+		vm_free_list[area]->next = 0;
+	}
+
+	vm_used_list = vm_lazy_list = 0;
+	vm_lazy_pages = 0;
+	mm_tlb_gather_init(&vm_lazy_tlb);
+
+	return 0;
+}
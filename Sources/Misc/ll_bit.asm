@@ -9,13 +9,18 @@
 ; Initial release: 2005-05-13
 ;
 
-GLOBAL bit_find_set, bit_find_reset, bit_set, bit_reset, bit_invert, bit_test
+GLOBAL bit_find_set, bit_find_last_set, bit_find_reset, bit_set, bit_reset, bit_invert, bit_test
 
 ALIGN 16
 bit_find_set:
 	bsf	eax, [esp + 4]
 	ret
 
+ALIGN 16
+bit_find_last_set:
+	bsr	eax, [esp + 4]
+	ret
+
 ALIGN 16
 bit_find_reset:
 	mov	edx, [esp + 4]
@@ -0,0 +1,47 @@
+;
+; Misc/ll_lock.asm
+; Written by The Neuromancer <neuromancer at paranoici dot org>
+;
+; This file is part of the Klesh operating system.
+; Make sure you have read the license before copying, reading or
+; modifying this document.
+;
+; Initial release: 2026-10-17
+;
+
+GLOBAL lock_acquire, lock_release, lock_try
+
+; Spin with plain reads until the lock looks free, so the cache line is not
+; bounced between the processors, and only then try to take it
+ALIGN 16
+lock_acquire:
+	mov	edx, [esp + 4]
+
+.try:
+	mov	eax, 1
+	xchg	eax, [edx]
+	test	eax, eax
+	jnz	.spin
+
+	ret
+
+.spin:
+	pause
+	cmp	dword [edx], 0
+	jne	.spin
+	jmp	.try
+
+ALIGN 16
+lock_release:
+	mov	edx, [esp + 4]
+	mov	dword [edx], 0
+	ret
+
+; Returns 1 if the lock was taken
+ALIGN 16
+lock_try:
+	mov	edx, [esp + 4]
+	mov	eax, 1
+	xchg	eax, [edx]
+	xor	eax, 1
+	ret
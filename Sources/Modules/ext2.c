@@ -20,6 +20,7 @@
 static unsigned int sectors_per_block;
 static unsigned int inodes_per_table;		// Inodes per inode table block
 static unsigned char *block_buffer;
+static struct mm_slab_cache inode_cache, block_group_cache;
 
 // Superblock
 static struct __attribute__((packed)) ext2_superblock
@@ -148,7 +149,7 @@ unsigned int block_index;
 
 	// Read and allocate a block group
 	ext2_block_read(block_index);
-	ret = (struct ext2_block_group *)mm_heap_allocate(sizeof(struct ext2_block_group));
+	ret = (struct ext2_block_group *)mm_slab_allocate(&block_group_cache);
 	if (!ret)
 		return ERROR_NO_MEMORY;
 	memory_copy(ret, block_buffer, sizeof(struct ext2_block_group));
@@ -177,7 +178,7 @@ struct ext2_block_group *block_group;
 
 	// Read the inode table block
 	ext2_block_read(block_group->inode_table_block + table_index);
-	mm_heap_free(block_group);
+	mm_slab_free(&block_group_cache, block_group);
 
 	// Copy the inode
 	memory_copy(inode, &block_buffer[table_inode_index * sizeof(struct ext2_inode)], sizeof(struct ext2_inode));
@@ -243,7 +244,7 @@ unsigned char *ptr;
 		return ERROR_INVALID;
 	path++;			// Skip the slash
 
-	cur_inode = (struct ext2_inode *)mm_heap_allocate(sizeof(struct ext2_inode));
+	cur_inode = (struct ext2_inode *)mm_slab_allocate(&inode_cache);
 	if (!cur_inode)
 		return ERROR_NO_MEMORY;
 
@@ -322,7 +323,7 @@ unsigned int count_block, block_index, block_offset, block_size, length, i = 0;
 
 err_t ext2_close(void *handle)
 {
-	mm_heap_free(handle);
+	mm_slab_free(&inode_cache, handle);
 
 	return 0;
 }
@@ -360,5 +361,9 @@ char name[256];
 	// Calculate run-time data
 	inodes_per_table = (sectors_per_block * 512) / sizeof(struct ext2_inode);
 
+	// Inodes of the open files and block group descriptors come from their own caches
+	return_on_failure(mm_slab_cache_init(&inode_cache, "ext2 inode", sizeof(struct ext2_inode), 0));
+	return_on_failure(mm_slab_cache_init(&block_group_cache, "ext2 block group", sizeof(struct ext2_block_group), 0));
+
 	return 0;
 }
@@ -51,7 +51,6 @@ static struct floppy_type {
 	{ "2.88MB 3.5\"", 0 },
 };
 static unsigned		found_drives = 0;
-static unsigned char	*dma_buffer;
 
 // Flags
 static unsigned		fdc_interrupt_flag = 0;			// A FDC interrupt has been received
@@ -120,8 +119,6 @@ uint8_t msr;
 unsigned int timeout;
 
 	va_start(args, count);
-	
-	process_schedule_disable();
 
 	while (count--) {
 		// Timed check for RQM == 1 and DIO == 0 in MSR
@@ -143,8 +140,6 @@ got_interrupt:
 
 		port_write_byte(FDC_PORT_DATA, va_arg(args, uint8_t));
 	}
-	
-	process_schedule_enable();
 
 	va_end(args);
 
@@ -158,8 +153,6 @@ uint8_t msr;
 unsigned int timeout;
 
 	va_start(args, count);
-	
-	process_schedule_disable();
 
 	while (count--) {
 		timeout = 100;
@@ -180,8 +173,6 @@ got_interrupt:
 
 		port_read_byte(FDC_PORT_DATA, va_arg(args, uint8_t *));
 	}
-	
-	process_schedule_enable();
 
 	va_end(args);
 
@@ -244,50 +235,82 @@ static err_t fdc_seek(unsigned drive, uint8_t track)
 }
 	
 
+/*
+ * Read sectors straight into the buffer, through bounce buffers only where the
+ * DMA controller cannot reach it. Every command reads the sectors of a segment
+ * which are on the same track.
+ */
 err_t fdc_read(void *buffer, unsigned int lba, size_t sector_count)
 {
 uint8_t head, cylinder, sector, st0, st1, st2, n;
-int i;
-unsigned int cur_sector;
+struct dma_map map;
+struct dma_segment *segment;
+unsigned int i, count;
+size_t done;
+err_t ret = 0;
 
 	fdc_motor_control(0, 1);
 
-	cur_sector = lba;
-
-	while (sector_count--) {
-		// Calculate CHS from LBA
-		head = (cur_sector % (18 * 2)) / (18);
-	  	cylinder = cur_sector / (18 * 2);
-		sector = cur_sector % 18 + 1;
-
-		// Seek to the right track
-		fdc_seek(0, cylinder);
-
-		// Setup DMA and interrupts
-		dma_transfer(2, dma_buffer, FLOPPY_BLOCK_SIZE, 1);	
-		fdc_interrupt_wait_flag = 1;
-
-		// Send command
-		fdc_send(9, FDC_COMMAND_READ_SECTOR, head << 2, cylinder, head, sector, 2, 18, 0x1B, 0xFF);
-
-		// Wait for completion
-		if (fdc_interrupt_wait(1000, 0)) {
-			console_write("FDC: floppy has timed out during reading... aborting\n");
-			return ERROR_TIMEOUT;
+	while (sector_count) {
+		ret = dma_map(&map, buffer, sector_count * FLOPPY_BLOCK_SIZE, FLOPPY_BLOCK_SIZE, 1);
+		if (ret)
+			break;
+
+		for (i = 0; i < map.count; i++) {
+			segment = &map.segment[i];
+
+			for (done = 0; done < segment->length; done += count * FLOPPY_BLOCK_SIZE) {
+				// Calculate CHS from LBA
+				head = (lba % (18 * 2)) / (18);
+				cylinder = lba / (18 * 2);
+				sector = lba % 18 + 1;
+
+				// Up to the end of the track
+				count = min((segment->length - done) / FLOPPY_BLOCK_SIZE, 18 - sector + 1);
+
+				// Seek to the right track
+				ret = fdc_seek(0, cylinder);
+				if (ret) {
+					dma_unmap(&map);
+					goto out;
+				}
+
+				// Setup DMA and interrupts. The controller stops the command when the count is over
+				ret = dma_transfer_physical(2, segment->physical + done, count * FLOPPY_BLOCK_SIZE, 1);
+				if (ret) {
+					dma_unmap(&map);
+					goto out;
+				}
+				fdc_interrupt_wait_flag = 1;
+
+				// Send command
+				fdc_send(9, FDC_COMMAND_READ_SECTOR, head << 2, cylinder, head, sector, 2, 18, 0x1B, 0xFF);
+
+				// Wait for completion
+				if (fdc_interrupt_wait(1000, 0)) {
+					console_write("FDC: floppy has timed out during reading... aborting\n");
+					dma_unmap(&map);
+					ret = ERROR_TIMEOUT;
+					goto out;
+				}
+
+				// Read status
+				fdc_get(7, &st0, &st1, &st2, &cylinder, &head, &sector, &n);
+
+				lba += count;
+			}
 		}
 
-		// Read status
-		fdc_get(7, &st0, &st1, &st2, &cylinder, &head, &sector, &n);
+		buffer += map.length;
+		sector_count -= map.length / FLOPPY_BLOCK_SIZE;
 
-		memory_copy(buffer, dma_buffer, FLOPPY_BLOCK_SIZE);
-
-		buffer += FLOPPY_BLOCK_SIZE;
-		cur_sector++;
+		dma_unmap(&map);
 	}
 
+out:
 	fdc_motor_control(0, 0);
 
-	return 0;
+	return ret;
 }
 
 /******************
@@ -323,7 +346,6 @@ err_t fdc_init(void)
 {
 uint8_t fd_types;
 err_t ret;
-void *buffer;
 
 	/* Read on the CMOS the number of floppy drives */
 	fd_types = cmos_read(0x10);
@@ -340,9 +362,6 @@ void *buffer;
 	interrupt_irq_register(6, fdc_isr);
 	interrupt_irq_enable(6);
 
-	// Allocate a DMA buffer
-	mm_dma_allocate(FLOPPY_BLOCK_SIZE, (void **)&dma_buffer);
-
 	// Reset drive
 	ret = fdc_reset();
 	if (ret)
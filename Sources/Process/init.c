@@ -19,11 +19,12 @@
 #include <kernel.h>
 
 /* From x86.asm */
-extern union dt_entry _gdt[];
-extern struct tss _kernel_tss;
 extern void process_ltr(uint16_t descriptor);
 extern uint32_t _process_page_directory[1024];
-extern void _freeze(void);
+
+struct mm_slab_cache process_cache, thread_cache;
+
+struct process *kernel_process;
 
 err_t process_init(void)
 {
@@ -31,11 +32,14 @@ err_t process_init(void)
 struct thread *init_thread;
 err_t ret;
 uint32_t idle_stack;
-struct process *kernel_process;
 
 	total_processes = 0;
 	total_threads = 0;
 
+	if (mm_slab_cache_init(&process_cache, "process", sizeof(struct process), 0) ||
+		mm_slab_cache_init(&thread_cache, "thread", sizeof(struct thread), 0))
+		kernel_panic("Unable to create the process caches!");
+
 	/******************************
 	 * Create the free PID bitmap *
 	 ******************************/
@@ -49,7 +53,7 @@ struct process *kernel_process;
 	 * Create the kernel process *
 	 *****************************/
 
-	current_process = kernel_process = (struct process *)mm_heap_allocate(sizeof(struct process));
+	process_cpu_process[0] = kernel_process = (struct process *)mm_slab_allocate(&process_cache);
 	if (!kernel_process)
 		kernel_panic("No memory to create the kernel process!");
 	memory_clear(kernel_process, sizeof(struct process));
@@ -66,7 +70,7 @@ struct process *kernel_process;
 	 *****************************/
 	
 	// Init thread (this one)
-	current_thread = init_thread = (struct thread *)mm_heap_allocate(sizeof(struct thread));
+	process_cpu_thread[0] = init_thread = (struct thread *)mm_slab_allocate(&thread_cache);
 	if (!init_thread)
 		kernel_panic("Unable to initialize kernel threads! Error code %u", ERROR_NO_MEMORY);
 	memory_clear(init_thread, sizeof(struct thread));
@@ -77,9 +81,10 @@ struct process *kernel_process;
 	total_threads++;
 
 	// Idle thread. It prevents the system from locking up when no more threads are available
-	ret = process_thread_create(kernel_process, priorityIdle, (uint32_t)_freeze, PROCESS_THREAD_STACK_MIN);
+	ret = process_thread_create(kernel_process, priorityIdle, (uint32_t)process_thread_idle, PROCESS_THREAD_STACK_MIN);
 	if (ret)
 		kernel_panic("Unable to initialize kernel threads! Error code %u", ret);
+	process_cpu_idle[0] = kernel_process->thread_list;
 	#if 0
 	// Zombie slayer thread. Kills zombie threads
 	ret = process_thread_create(kernel_process, priorityNormal, (uint32_t)process_thread_slayer, PROCESS_THREAD_STACK_MIN);
@@ -87,42 +92,81 @@ struct process *kernel_process;
 		kernel_panic("Unable to initialize kernel threads! Error code %u", ret);
 	#endif
 
-	/*************************
-	 * Create the kernel TSS *
-	 *************************/
+	ret = process_init_tss(0);
+	if (ret)
+		kernel_panic("Unable to initialize the processor tasks! Error code %u", ret);
 
-	/* Set up the descriptor */
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.type = CPU_GDT_TYPE_TASK;
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.access = CPU_GDT_ACCESS_PRESENT | CPU_GDT_ACCESS_DPL_0;
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.flags = CPU_GDT_FLAG_AVAILABLE;
+	/* From now on page faults are handled on a stack of their own */
+	process_ltr(CPU_GDT_INDEX_TSS_KERNEL * sizeof(union dt_entry));
+	interrupt_init_tasks();
+		
+	console_write_formatted("%x\n", kernel_process->thread_list->priority);
 
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.limit_low = sizeof(struct tss) - 1;
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.base_low = (unsigned int)&_kernel_tss & 0xFFFF;
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.base_med = ((unsigned int)&_kernel_tss >> 16) & 0xFF;
-	_gdt[CPU_GDT_INDEX_TSS_KERNEL].desc.base_high = ((unsigned int)&_kernel_tss >> 24) & 0xFF;
+	return 0;
+}
+
+/*
+ * Set up the kernel TSS of a processor, with its ring 0 stack, and its page
+ * fault and double fault tasks. The descriptors are in its GDT (see
+ * cpu_gdt_init). The boot processor does this for the others before starting
+ * them, since their first page fault already switches task, and each one
+ * loads its task register itself.
+ */
+err_t process_init_tss(unsigned int cpu)
+{
+struct tss *tss = &cpu_data[cpu].tss;
 
-	/* Set up the TSS. */
-	memory_clear(&_kernel_tss, sizeof(struct tss));
+	memory_clear(tss, sizeof(struct tss));
 	
-	_kernel_tss.ss0 = 0x10;
-	_kernel_tss.esp0 = (uint32_t)mm_heap_allocate(4096);
-	if (!_kernel_tss.esp0)
-		kernel_panic("Not enough memory to create the kernel mode stack!");
-
-	/*
-	 * Now we can initialize the double fault handler
-	 */
-	ret = interrupt_init_doublefault();
-	if (ret)
-		kernel_panic("Unable to initialize the double fault handler! Error code %u", ret);
-		
-	console_write_formatted("%x\n", kernel_process->thread_list->priority);
+	tss->ss0 = 0x10;
+	tss->esp0 = (uint32_t)mm_heap_allocate_aligned(CPU_PAGE_SIZE, CPU_PAGE_SIZE);
+	if (!tss->esp0)
+		return ERROR_NO_MEMORY;
 
-	/*
-	 * Load the Task Register with the kernel TSS descriptor
-	 */
+	/* The processor switches to this stack on its own, and cannot take a page fault there */
+	return_on_failure(mm_map_commit(tss->esp0 >> 12, 1));
+	tss->esp0 += CPU_PAGE_SIZE;
 
-	process_ltr(CPU_GDT_INDEX_TSS_KERNEL * sizeof(union dt_entry));
+	/* Returning from the page fault task loads CR3 from here (see cpu_mmu_switch) */
+	tss->cr3 = (uint32_t)_process_page_directory;
 
-	return 0;
+	return_on_failure(interrupt_init_doublefault(cpu));
+
+	return interrupt_init_pagefault(cpu);
+}
+
+/*
+ * Called by every other processor as it starts. The code running becomes
+ * its idle thread, which is switched out as soon as there is work.
+ */
+void process_init_cpu(void)
+{
+unsigned int cpu = cpu_current();
+struct thread *idle_thread;
+uint32_t eflags;
+
+	idle_thread = (struct thread *)mm_slab_allocate(&thread_cache);
+	if (!idle_thread)
+		kernel_panic("Unable to initialize kernel threads! Error code %u", ERROR_NO_MEMORY);
+	memory_clear(idle_thread, sizeof(struct thread));
+
+	idle_thread->priority = priorityIdle;
+	idle_thread->parent = kernel_process;
+	idle_thread->cpu = cpu;
+	idle_thread->status = statusReady;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	idle_thread->next = kernel_process->thread_list;
+	kernel_process->thread_list->previous = idle_thread;
+	kernel_process->thread_list = idle_thread;
+	kernel_process->thread_count++;
+	total_threads++;
+
+	process_cpu_idle[cpu] = process_cpu_thread[cpu] = idle_thread;
+	process_cpu_process[cpu] = kernel_process;
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
 }
@@ -18,8 +18,6 @@
 #include <cpu.h>
 #include <interrupt.h>
 
-extern void _dummy_page_directory, _process_page_directory;
-
 unsigned int alloc_pid(void)
 {
 unsigned int i, ret;
@@ -36,47 +34,163 @@ unsigned int i, ret;
 	return -1;
 }
 
-err_t process_create(unsigned char *name, unsigned char *path)
+static void free_pid(unsigned int pid)
 {
-struct process *process;
+	free_pid_bitmap[pid / 32] = bit_set(free_pid_bitmap[pid / 32], pid % 32);
+}
 
-	if (mm_ppage_get_free() < 1)
-		return ERROR_NO_MEMORY;
+/* Allocate a process with a first thread starting at eip. The address space is left to the caller */
+static struct process *process_allocate(unsigned char *name, uint32_t eip)
+{
+struct process *process;
 
-	process = (struct process *)mm_heap_allocate(sizeof(struct process));
+	process = (struct process *)mm_slab_allocate(&process_cache);
 	if (!process)
-		return ERROR_NO_MEMORY;
+		return 0;
 	memory_clear(process, sizeof(struct process));
 
 	// Initialize process structure
 	process->name = name;
 	process->pid = alloc_pid();
 	
-	// Create process loading thread
-	if (process_thread_create(process, priorityNormal, (uint32_t)process_loader, PROCESS_THREAD_STACK_DEFAULT)) {
-		mm_heap_free(process);
-		return ERROR_NO_MEMORY;
+	// Create process first thread
+	if (process_thread_create(process, priorityNormal, eip, PROCESS_THREAD_STACK_DEFAULT)) {
+		mm_slab_free(&process_cache, process);
+		return 0;
 	}
-	
-	// Initialize process memory
-	mm_ppage_pop(&process->page_directory, 1);
-	mm_map_page_directory(process->page_directory);
-	memory_clear(&_dummy_page_directory, CPU_PAGE_SIZE);
-	memory_copy(&_dummy_page_directory, &_process_page_directory, (MM_AREA_KERNEL_END / 0x400000) * sizeof(uint32_t));
-	
-	// Put the process in the process list
+
+	return process;
+}
+
+/* Free a process which is not in the process list, with its threads and areas. The address space is left to the caller */
+static void process_free(struct process *process)
+{
+struct thread *thread;
+
+	while ((thread = process->thread_list)) {
+		process->thread_list = thread->next;
+		process_thread_destroy(thread);
+		total_threads--;
+	}
+
+	mm_vma_destroy(&process->vmas);
+	free_pid(process->pid);
+	mm_slab_free(&process_cache, process);
+}
+
+/* Put the process in the process list, so its threads get scheduled */
+static void process_insert(struct process *process)
+{
+struct thread *thread;
+
 	interrupt_disable();
 	process_list->previous = process;
 	process->next = process_list;
 	process_list = process;
+
+	for (thread = process->thread_list; thread; thread = thread->next)
+		if (thread->status == statusReady)
+			process_schedule_enqueue(thread);
 	interrupt_enable();
 	
 	total_processes++;
+}
+
+err_t process_create(unsigned char *name, unsigned char *path)
+{
+struct process *process;
+
+	if (mm_ppage_get_free() < 1)
+		return ERROR_NO_MEMORY;
+
+	process = process_allocate(name, (uint32_t)process_loader);
+	if (!process)
+		return ERROR_NO_MEMORY;
+	
+	// Initialize process memory
+	if (mm_space_create(&process->page_directory)) {
+		process_free(process);
+		return ERROR_NO_MEMORY;
+	}
+	
+	process_insert(process);
+
+	return 0;
+}
+
+/*
+ * Create a process with a copy of the address space of the current one, and a
+ * first thread starting at eip. The user pages are shared until written, so
+ * the cost depends on the page tables in use and not on the resident pages.
+ */
+err_t process_clone(unsigned char *name, uint32_t eip, struct process **child)
+{
+struct process *process;
+err_t ret;
+
+	process = process_allocate(name, eip);
+	if (!process)
+		return ERROR_NO_MEMORY;
+
+	ret = mm_vma_clone(current_process->vmas, &process->vmas);
+	if (!ret)
+		ret = mm_space_clone(&process->page_directory);
+	if (ret) {
+		process_free(process);
+		return ret;
+	}
+
+	process_insert(process);
+
+	if (child)
+		*child = process;
 
 	return 0;
 }
 
+/*
+ * Terminate a process and give back everything it holds. Its page tables and
+ * the frames they map are released a table at a time (see mm_space_destroy).
+ * A process cannot tear down the space it is running in, so the kernel and
+ * the ones running on any processor are refused.
+ */
 err_t process_terminate(struct process *process)
 {
+struct thread *thread;
+uint32_t eflags;
+unsigned int cpu;
+
+	if (!process->pid)
+		return ERROR_INVALID;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	for (cpu = 0; cpu < CPU_MAX; cpu++)
+		if (process_cpu_process[cpu] == process) {
+			if (eflags & CPU_FLAG_INTERRUPT)
+				interrupt_enable();
+
+			return ERROR_INVALID;
+		}
+
+	if (process->previous)
+		process->previous->next = process->next;
+	else
+		process_list = process->next;
+	if (process->next)
+		process->next->previous = process->previous;
+
+	for (thread = process->thread_list; thread; thread = thread->next)
+		process_schedule_dequeue(thread);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	total_processes--;
+
+	mm_space_destroy(process->page_directory);
+	process_free(process);
+
 	return 0;
 }
@@ -13,52 +13,176 @@
 #include <process.h>
 #include <mm.h>
 #include <cpu.h>
+#include <bit.h>
+#include <smp.h>
 
-extern struct process *kernel_process;
+/*
+ * Ready queues.
+ *
+ * Every processor has a FIFO for each priority of the threads which are
+ * ready to run on it, and a bit of its bitmap is set for each queue which is
+ * not empty, so the highest priority with work is found with a single bsr.
+ * The running thread is not in any queue: it goes back to the tail of its own
+ * when it is switched out still ready, so threads of the same priority take
+ * turns. Sleeping and zombie threads are never in a queue. Lower priorities
+ * only run when the higher ones have nothing ready, and the idle thread of
+ * the processor, which is never queued, only when nothing else is.
+ *
+ * A processor which runs out of threads takes the first one of the highest
+ * priority from the queues of another. A thread made ready wakes up its
+ * processor if it is idle or running a lower priority, or else another idle
+ * one. The running thread going back to its queue wakes up nobody. A thread stays on the processor
+ * which last ran it, where its data is still in the cache, until it is
+ * taken by another one.
+ *
+ * Interrupts must be disabled around all of this: the interrupt lock keeps
+ * out the other processors too.
+ */
+
+static struct run_queue {
+	struct thread	*head[PROCESS_PRIORITIES];
+	struct thread	*tail[PROCESS_PRIORITIES];
+	unsigned int	bitmap;
+	unsigned int	count;		/* Threads queued */
+} run_queue[CPU_MAX];
 
-void process_schedule_disable(void)
+/* Whether a processor is running its idle thread */
+#define process_schedule_idle(cpu)	(cpu_data[cpu].online && (process_cpu_thread[cpu] == process_cpu_idle[cpu]))
+
+/* Put a ready thread at the tail of its queue */
+static void process_schedule_queue(struct thread *thread)
 {
-	interrupt_irq_disable(0);
+struct run_queue *queue = &run_queue[thread->cpu];
+enum processPriority priority = thread->priority;
+
+	thread->run_next = 0;
+	thread->run_previous = queue->tail[priority];
+
+	if (queue->tail[priority])
+		queue->tail[priority]->run_next = thread;
+	else
+		queue->head[priority] = thread;
+
+	queue->tail[priority] = thread;
+	queue->bitmap |= 1 << priority;
+	queue->count++;
 }
 
-void process_schedule_enable(void)
+/* Queue a thread which has just become ready, and have a processor run it */
+void process_schedule_enqueue(struct thread *thread)
 {
-	interrupt_irq_enable(0);
+unsigned int cpu, self;
+
+	process_schedule_queue(thread);
+
+	/* Its own processor if it is idle or running something less urgent. This one looks at its queues anyway */
+	self = cpu_current();
+	if (process_schedule_idle(thread->cpu) || (process_cpu_thread[thread->cpu]->priority < thread->priority)) {
+		if (thread->cpu != self)
+			smp_reschedule(thread->cpu);
+		return;
+	}
+
+	for (cpu = 0; cpu < CPU_MAX; cpu++)
+		if ((cpu != self) && process_schedule_idle(cpu)) {
+			smp_reschedule(cpu);
+			return;
+		}
 }
 
-/* process_schedule - Selects the next thread to run and switches.
+/* Take a thread out of its queue, if it is there */
+void process_schedule_dequeue(struct thread *thread)
+{
+struct run_queue *queue = &run_queue[thread->cpu];
+enum processPriority priority = thread->priority;
+
+	if (!thread->run_previous && (queue->head[priority] != thread))
+		return;
+
+	if (thread->run_previous)
+		thread->run_previous->run_next = thread->run_next;
+	else
+		queue->head[priority] = thread->run_next;
+
+	if (thread->run_next)
+		thread->run_next->run_previous = thread->run_previous;
+	else
+		queue->tail[priority] = thread->run_previous;
+
+	thread->run_previous = thread->run_next = 0;
+	queue->count--;
+
+	if (!queue->head[priority])
+		queue->bitmap &= ~(1 << priority);
+}
+
+/* Some thread other than the running one can run here. Interrupts must be disabled */
+unsigned int process_schedule_ready(void)
+{
+unsigned int cpu;
+
+	if (run_queue[cpu_current()].bitmap)
+		return 1;
+
+	for (cpu = 0; cpu < CPU_MAX; cpu++)
+		if (run_queue[cpu].count)
+			return 1;
+
+	return 0;
+}
+
+/* The first thread of the highest priority queued on another processor, or 0 */
+static struct thread *process_schedule_steal(unsigned int self)
+{
+struct thread *thread = 0;
+unsigned int cpu;
+int priority, best = -1;
+
+	for (cpu = 0; cpu < CPU_MAX; cpu++) {
+		if ((cpu == self) || !run_queue[cpu].bitmap)
+			continue;
+
+		priority = bit_find_last_set(run_queue[cpu].bitmap);
+		if (priority > best) {
+			best = priority;
+			thread = run_queue[cpu].head[priority];
+		}
+	}
+
+	return thread;
+}
+
+/* process_schedule - Selects the next thread to run on this processor and switches.
 */
 struct thread *process_schedule(void)
 {
-struct thread *old_thread;
+struct thread *old_thread, *thread;
 struct process *old_process;
+unsigned int cpu = cpu_current();
 
-	old_thread = current_thread;
-	old_process = current_process;
-	
-	current_thread = old_thread->next;
-	while (1) {
-		// Find the next ready thread in the current process.
-		while (current_thread) {
-			if (current_thread->status == statusReady)
-				goto found;
-
-			current_thread = current_thread->next;
-		}
+	old_thread = process_cpu_thread[cpu];
+	old_process = process_cpu_process[cpu];
 
-		// No threads found in the current process, so switch
-		if (current_process->next)
-			current_process = current_process->next;
-		else
-			current_process = process_list;		// Restart from the first process
+	if ((old_thread->status == statusReady) && (old_thread != process_cpu_idle[cpu]))
+		process_schedule_queue(old_thread);
 
-		current_thread = current_process->thread_list;
-	}
+	if (run_queue[cpu].bitmap)
+		thread = run_queue[cpu].head[bit_find_last_set(run_queue[cpu].bitmap)];
+	else
+		thread = process_schedule_steal(cpu);
+
+	if (thread) {
+		process_schedule_dequeue(thread);
+		thread->cpu = cpu;
+	} else
+		thread = process_cpu_idle[cpu];
+
+	process_cpu_thread[cpu] = thread;
+	process_cpu_process[cpu] = thread->parent;
 
-found:
 	// If we have switched the process, change the page directory
-	if (old_process != current_process)
-		cpu_mmu_switch(current_process->page_directory);
+	if (old_process != thread->parent)
+		cpu_mmu_switch(thread->parent->page_directory);
 
 	return old_thread;
 }
@@ -53,28 +53,39 @@ uint32_t eflags;
 	return 0;
 }
 
+static void process_thread_timeout(void *data)
+{
+struct thread *thread = (struct thread *)data;
+
+	if (thread->status == statusSleeping) {
+		thread->status = statusReady;
+		process_schedule_enqueue(thread);
+	}
+}
+
+/*
+ * Sleep for at least ms milliseconds. The thread is off the ready queues
+ * until its timer expires. With 0 it just gives the processor away.
+ */
 err_t process_thread_sleep_time(unsigned int ms)
 {
-unsigned int end_time;
 uint32_t eflags;
 
 	eflags = cpu_flags_get();
 	interrupt_disable();
 	
+	// Convert the timeout from ms to timer ticks
+	ms /= TIMER_GRANULARITY_MS;
+
 	if (ms) {
+		timer_setup(&current_thread->timer, process_thread_timeout, current_thread);
+		timer_add(&current_thread->timer, ms);
 
-		// Convert the timeout from ms to timer ticks
-		ms /= TIMER_GRANULARITY_MS;
-		end_time = _ticks + ms;
-		
-		while (_ticks < end_time)
-			process_thread_reschedule(eflags);
-	} else {
-		
-		process_thread_reschedule(eflags);
-		
+		current_thread->status = statusSleeping;
 	}
 
+	process_thread_reschedule(eflags);
+
 	return 0;
 }
 
@@ -86,7 +97,10 @@ unsigned int i;
 
 	// Wake up all the waiter threads
 	for (i = 0; i < obj->waiter_count; i++) {
-		obj->waiter[i]->status = statusReady;
+		if (obj->waiter[i]->status == statusSleeping) {
+			obj->waiter[i]->status = statusReady;
+			process_schedule_enqueue(obj->waiter[i]);
+		}
 		obj->waiter[i]->cur_sleep_object = 0;
 	}
 
@@ -103,88 +117,137 @@ unsigned int i;
 
 void process_thread_slayer(void)
 {
-struct thread *thread;
+struct thread *thread, *next;
 struct process *process;
 
 	process = process_list;
 	thread = process->thread_list;
 	while (1) {
+		/* The thread may be destroyed below, so take its successor first */
+		next = thread->next;
+
 		if (thread->status == statusZombie) {
 			interrupt_disable();
 			if (thread->next)
 				thread->next->previous = thread->previous;
 			if (thread->previous)
 				thread->previous->next = thread->next;
+			else
+				process->thread_list = thread->next;
 			interrupt_enable();
 			
-			mm_heap_free(thread);
+			process_thread_destroy(thread);
 			total_threads--;
 			process->thread_count--;
 		}
 		
-		if (thread->next)
-			thread = thread->next;
+		if (next)
+			thread = next;
 		else if (process->next) {
 			process = process->next;
 			thread = process->thread_list;
 		} else {
 			process_thread_sleep_time(0);
+
+			/* Start over, the thread we were on may be gone */
+			process = process_list;
+			thread = process->thread_list;
 		}			
 	}
 }
 
+/* Idle thread. Don't call directly */
+
+void process_thread_idle(void)
+{
+	while (1) {
+		// Use the spare time to clear pages for who will need them
+		mm_ppage_zero_refill();
+
+		// An interrupt may have woken someone up, otherwise sleep until the next timer
+		if (process_schedule_ready())
+			process_thread_sleep_time(0);
+		else
+			timer_idle();
+	}
+}
+
 /* Thread creation */
 
 err_t process_thread_create(struct process *parent, enum processPriority priority, uint32_t eip, uint32_t stack_size)
 {
 struct thread *thread;
-err_t ret;
+uint32_t stack_top, eflags;
 
 	// Sanity check on the input
 	if (!parent || (stack_size < PROCESS_THREAD_STACK_MIN) || (stack_size > PROCESS_THREAD_STACK_MAX))
 		return ERROR_INVALID;
 	
-	thread = (struct thread *)mm_heap_allocate(sizeof(struct thread));
+	thread = (struct thread *)mm_slab_allocate(&thread_cache);
 	if (!thread)
 		return ERROR_NO_MEMORY;
 	memory_clear(thread, sizeof(struct thread));
 
 	thread->priority = priority;
 	thread->parent = parent;
+	thread->cpu = cpu_current();
 	thread->status = statusReady;
 
-	/* Allocate a stack for the new thread */
-	thread->esp = (uint32_t)mm_heap_allocate(stack_size);
-	if (!thread->esp) {
-		mm_heap_free(thread);
+	/*
+	 * Reserve a stack for the new thread. Its pages are backed, already cleared,
+	 * as the stack grows into them, and an overflow hits a guard page.
+	 */
+	if (mm_vstack(stack_size, (void **)&thread->stack)) {
+		mm_slab_free(&thread_cache, thread);
 		return ERROR_NO_MEMORY;
 	}
-	
-	memory_clear((void *)thread->esp, stack_size);
-	thread->esp += stack_size - 11 * 4;
+
+	/* Back the top page now, which gets the first frame */
+	stack_top = thread->stack + (size_in_pages(stack_size) << 12);
+	if (mm_map_commit((stack_top >> 12) - 1, 1)) {
+		mm_vfree((void *)thread->stack);
+		mm_slab_free(&thread_cache, thread);
+		return ERROR_NO_MEMORY;
+	}
+
+	thread->esp = stack_top - 11 * 4;
 	*(uint32_t *)(thread->esp + 4*8) = eip;
 	*(uint32_t *)(thread->esp + 4*9) = 0x08;
 	*(uint32_t *)(thread->esp + 4*10) = 0x200;
 	
-	/* Allocate a kernel stack */
-	thread->kernel_esp = (uint32_t)mm_heap_allocate(PROCESS_THREAD_STACK_DEFAULT);
-	if (!thread->kernel_esp) {
-		mm_heap_free((void *)thread->esp);
-		mm_heap_free(thread);
-		return ERROR_NO_MEMORY;
-	}
+	eflags = cpu_flags_get();
+	interrupt_disable();
 
 	thread->next = parent->thread_list;
 	thread->previous = 0;
-	parent->thread_list->previous = thread;
+	if (parent->thread_list)
+		parent->thread_list->previous = thread;
 	parent->thread_list = thread;
 	parent->thread_count++;
 
+	/*
+	 * Threads of a process which is not in the list yet are queued when it
+	 * gets there. Idle threads are never queued (see schedule.c)
+	 */
+	if ((priority != priorityIdle) && ((parent == process_list) || parent->previous))
+		process_schedule_enqueue(thread);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
 	total_threads++;
 
 	return 0;
 }
 
+/* Free a thread which is not linked anywhere and will never run again */
+void process_thread_destroy(struct thread *thread)
+{
+	timer_cancel(&thread->timer);
+	mm_vfree((void *)thread->stack);
+	mm_slab_free(&thread_cache, thread);
+}
+
 /* Thread kill */
 
 err_t process_thread_terminate(struct thread *thread)
@@ -195,6 +258,7 @@ uint32_t eflags;
 	interrupt_disable();
 	
 	thread->status = statusZombie;
+	process_schedule_dequeue(thread);
 	
 	process_thread_reschedule(eflags);
 	
@@ -0,0 +1,247 @@
+/*
+ * apic.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Local APIC.
+ *
+ * The local APIC is left in virtual wire mode, so the 8259 still delivers
+ * the IRQs through LINT0, and only its timer is used. The timer runs at the
+ * bus frequency, which is unknown, so it is measured against counter 2 of
+ * the PIT. With the TSC-deadline mode the timer fires when the timestamp
+ * counter reaches a value instead: there is no periodic mode, so every tick
+ * arms the next one.
+ *
+ * Every processor has its own local APIC at the same address, and its own
+ * timer. Only the boot processor gets the 8259 and the NMI through its LINT
+ * pins; the others are reached by inter-processor interrupts.
+ */
+
+#include <apic.h>
+#include <cpu.h>
+#include <mm.h>
+#include <io.h>
+#include <timer.h>
+#include <interrupt.h>
+#include <kernel.h>
+
+/* From x86.asm */
+extern void _apic_timer_handler(void);
+extern void _apic_spurious_handler(void);
+
+/* From interrupt.c */
+extern void interrupt_set_handler(uint8_t number, void (*function)(void), unsigned access);
+
+#define apic_read(reg)		(apic_registers[(reg) >> 2])
+#define apic_write(reg, value)	(apic_registers[(reg) >> 2] = (value))
+
+volatile uint32_t *apic_registers;
+unsigned int apic_timer_max;
+
+static unsigned int apic_deadline;	/* The timer is in TSC-deadline mode */
+static uint32_t apic_timer_count;	/* Counts of a tick, of the timer or of the TSC */
+static uint64_t apic_tsc[CPU_MAX];	/* Last deadline, or when the one-shot was started */
+
+/*
+ * Map the registers and enable the local APIC. It fails if the processor has
+ * none, or if the firmware disabled it.
+ */
+err_t apic_init(void)
+{
+uint64_t base;
+void *registers;
+
+	if (!(_cpu.capabilities & CPU_CAPABILITY_APIC) || !(_cpu.capabilities & CPU_CAPABILITY_MSR))
+		return ERROR_NOT_AVAILABLE;
+
+	base = cpu_msr_read(APIC_MSR_BASE);
+	if (!(base & APIC_BASE_ENABLE))
+		return ERROR_NOT_AVAILABLE;
+
+	return_on_failure(mm_ioremap((uint32_t)base & APIC_BASE_ADDRESS, CPU_PAGE_SIZE,
+		CPU_PAGE_FLAG_WRITABLE | CPU_PAGE_FLAG_NOCACHE, &registers));
+	apic_registers = registers;
+
+	interrupt_set_handler(APIC_VECTOR_TIMER, _apic_timer_handler, CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+	interrupt_set_handler(APIC_VECTOR_SPURIOUS, _apic_spurious_handler, CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+
+	apic_init_cpu();
+
+	return 0;
+}
+
+/* Set up the local APIC of this processor */
+void apic_init_cpu(void)
+{
+	cpu_data[cpu_current()].apic_id = apic_read(APIC_REGISTER_ID) >> 24;
+
+	/* Virtual wire mode on the boot processor */
+	apic_write(APIC_REGISTER_TPR, 0);
+	if (!cpu_current()) {
+		apic_write(APIC_REGISTER_LVT_LINT0, APIC_LVT_DELIVERY_EXTINT);
+		apic_write(APIC_REGISTER_LVT_LINT1, APIC_LVT_DELIVERY_NMI);
+	} else {
+		apic_write(APIC_REGISTER_LVT_LINT0, APIC_LVT_MASKED);
+		apic_write(APIC_REGISTER_LVT_LINT1, APIC_LVT_MASKED);
+	}
+	apic_write(APIC_REGISTER_LVT_ERROR, APIC_LVT_MASKED);
+	apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_MASKED);
+	apic_write(APIC_REGISTER_SPURIOUS, APIC_SPURIOUS_ENABLE | APIC_VECTOR_SPURIOUS);
+}
+
+/*
+ * Send an inter-processor interrupt to the processor with the given APIC
+ * ID. command is the delivery mode and the vector
+ */
+void apic_ipi(unsigned int apic_id, uint32_t command)
+{
+	while (apic_read(APIC_REGISTER_ICR_LOW) & APIC_ICR_PENDING)
+		;
+
+	apic_write(APIC_REGISTER_ICR_HIGH, apic_id << 24);
+	apic_write(APIC_REGISTER_ICR_LOW, command);
+
+	while (apic_read(APIC_REGISTER_ICR_LOW) & APIC_ICR_PENDING)
+		;
+}
+
+/*********
+ * Timer *
+ *********/
+
+/*
+ * Measure the timer and the TSC over APIC_CALIBRATE_MS, and start the
+ * periodic tick. The PIT interrupt is left to the caller to mask.
+ */
+err_t apic_timer_init(void)
+{
+uint32_t eflags, count;
+uint64_t tsc;
+uint8_t gate, status;
+
+	if (!apic_registers)
+		return ERROR_NOT_AVAILABLE;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	apic_write(APIC_REGISTER_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+	apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_MASKED | APIC_VECTOR_TIMER);
+
+	/* Counter 2 starts with its gate high and the count loaded, and its output goes high at the end */
+	count = TIMER_8253_HZ / 1000 * APIC_CALIBRATE_MS;
+
+	port_read_byte(TIMER_8253_PORT_GATE, &gate);
+	port_write_byte(TIMER_8253_PORT_GATE, (gate & ~0x02) | 0x01);	/* Gate high, speaker off */
+	port_write_byte(TIMER_8253_PORT_CONTROL, (2 << 6) | (3 << 4) | (TIMER_8253_MODE_ONESHOT << 1));
+	port_write_byte(TIMER_8253_PORT_COUNTER2, count & 0xFF);
+	port_write_byte(TIMER_8253_PORT_COUNTER2, (count >> 8) & 0xFF);
+
+	apic_write(APIC_REGISTER_TIMER_INITIAL, 0xFFFFFFFF);
+	tsc = cpu_rdtsc();
+
+	// Stop if the APIC timer runs out first, as it would with a PIT that does not count
+	do
+		port_read_byte(TIMER_8253_PORT_GATE, &status);
+	while (!(status & 0x20) && apic_read(APIC_REGISTER_TIMER_CURRENT));
+
+	count = 0xFFFFFFFF - apic_read(APIC_REGISTER_TIMER_CURRENT);
+	tsc = cpu_rdtsc() - tsc;
+
+	apic_write(APIC_REGISTER_TIMER_INITIAL, 0);
+	port_write_byte(TIMER_8253_PORT_GATE, gate);
+
+	apic_timer_count = count / (APIC_CALIBRATE_MS / TIMER_GRANULARITY_MS);
+	if (!(status & 0x20) || !apic_timer_count) {
+		if (eflags & CPU_FLAG_INTERRUPT)
+			interrupt_enable();
+
+		return ERROR_NOT_AVAILABLE;
+	}
+
+	/* The deadline is 64-bit, so the one-shot has no limit of its own */
+	if (_cpu.capabilities & CPU_CAPABILITY_TSCDEADLINE) {
+		apic_deadline = 1;
+		apic_timer_count = (uint32_t)tsc / (APIC_CALIBRATE_MS / TIMER_GRANULARITY_MS);
+		apic_timer_max = 0xFFFFFFFF;
+	} else
+		apic_timer_max = 0xFFFFFFFF / apic_timer_count;
+
+	apic_timer_periodic();
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return 0;
+}
+
+/* Start the periodic tick */
+void apic_timer_periodic(void)
+{
+unsigned int cpu = cpu_current();
+
+	if (apic_deadline) {
+		apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_TIMER_TSC_DEADLINE | APIC_VECTOR_TIMER);
+
+		apic_tsc[cpu] = cpu_rdtsc() + apic_timer_count;
+		cpu_msr_write(APIC_MSR_TSC_DEADLINE, apic_tsc[cpu]);
+	} else {
+		apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_TIMER_PERIODIC | APIC_VECTOR_TIMER);
+		apic_write(APIC_REGISTER_TIMER_INITIAL, apic_timer_count);
+	}
+}
+
+/* Called on every periodic tick: in TSC-deadline mode, arm the next one */
+void apic_timer_tick(void)
+{
+uint64_t *tsc = &apic_tsc[cpu_current()];
+uint64_t now;
+
+	if (!apic_deadline)
+		return;
+
+	// Counting from the last deadline does not drift, unless the tick is already late
+	*tsc += apic_timer_count;
+	now = cpu_rdtsc();
+	if ((int64_t)(*tsc - now) <= 0)
+		*tsc = now + apic_timer_count;
+
+	cpu_msr_write(APIC_MSR_TSC_DEADLINE, *tsc);
+}
+
+/* Fire once, ticks from now. ticks is up to apic_timer_max */
+void apic_timer_oneshot(unsigned int ticks)
+{
+	if (apic_deadline) {
+		apic_tsc[cpu_current()] = cpu_rdtsc();
+		cpu_msr_write(APIC_MSR_TSC_DEADLINE, apic_tsc[cpu_current()] + (uint64_t)ticks * apic_timer_count);
+	} else {
+		apic_write(APIC_REGISTER_LVT_TIMER, APIC_LVT_TIMER_ONESHOT | APIC_VECTOR_TIMER);
+		apic_write(APIC_REGISTER_TIMER_INITIAL, ticks * apic_timer_count);
+	}
+}
+
+/* Whole ticks gone by since the one-shot was started */
+unsigned int apic_timer_elapsed(void)
+{
+	if (apic_deadline)
+		return (cpu_rdtsc() - apic_tsc[cpu_current()]) / apic_timer_count;
+
+	return (apic_read(APIC_REGISTER_TIMER_INITIAL) - apic_read(APIC_REGISTER_TIMER_CURRENT)) / apic_timer_count;
+}
+
+/* Stop the timer, until the next apic_timer_periodic or apic_timer_oneshot */
+void apic_timer_stop(void)
+{
+	if (apic_deadline)
+		cpu_msr_write(APIC_MSR_TSC_DEADLINE, 0);
+	else
+		apic_write(APIC_REGISTER_TIMER_INITIAL, 0);
+}
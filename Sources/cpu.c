@@ -24,7 +24,8 @@ extern int cpu_cpuid_supported(void);
 extern void cpu_cpuid_call(unsigned int level, unsigned int *eax, unsigned int *ebx,
 				unsigned int *ecx, unsigned int *edx);
 extern void _irq0_handler(void);
-extern unsigned long long cpu_rdtsc(void);
+extern union dt_entry _gdt[];
+extern void _cpu_mmu_switch(uint32_t page_directory, struct tss *kernel, struct tss *page_fault);
 
 /* From interrupt.c */
 extern void interrupt_set_handler(uint8_t number, void (*function)(void), unsigned access);
@@ -83,11 +84,20 @@ unsigned char buffer[64];
 
 	//console_write_formatted("CPU family: %u, model: %u, stepping: %u\n", _cpu.family, _cpu.model, _cpu.stepping);
 
+	if (edx & (1 << 3))	/* Page size extensions */
+		_cpu.capabilities |= CPU_CAPABILITY_PSE;
 	if (edx & (1 << 4))	/* Timestamp counter */
 		_cpu.capabilities |= CPU_CAPABILITY_TIMESTAMPCOUNTER;
+	if (edx & (1 << 5))	/* Model specific registers */
+		_cpu.capabilities |= CPU_CAPABILITY_MSR;
 	if (edx & (1 << 13) ||	/* Global pages. Early AMDs (SSA5) used bit 10 (APIC) to report it */
 		( (_cpu.vendor == vendorAMD) && (_cpu.family == 5) && (_cpu.model == 0) && (edx & (1 << 10)) ))
 		_cpu.capabilities |= CPU_CAPABILITY_GLOBALPAGES;
+	if ((edx & (1 << 9)) &&	/* Local APIC. The SSA5 used the bit for something else */
+		!( (_cpu.vendor == vendorAMD) && (_cpu.family == 5) && (_cpu.model == 0) ))
+		_cpu.capabilities |= CPU_CAPABILITY_APIC;
+	if ((_cpu.capabilities & CPU_CAPABILITY_APIC) && (ecx & (1 << 24)))	/* TSC-deadline timer */
+		_cpu.capabilities |= CPU_CAPABILITY_TSCDEADLINE;
 
 	/*
 	 * Get extended level information
@@ -215,6 +225,57 @@ asm(".globl _calibrate_isr   \n"
 	
 	
 	
+/**********************
+ * Per-processor GDTs *
+ **********************/
+
+struct cpu_data cpu_data[CPU_MAX];
+
+static void cpu_gdt_set_tss(union dt_entry *entry, struct tss *tss)
+{
+	entry->desc.type = CPU_GDT_TYPE_TASK;
+	entry->desc.access = CPU_GDT_ACCESS_PRESENT | CPU_GDT_ACCESS_DPL_0;
+	entry->desc.flags = CPU_GDT_FLAG_AVAILABLE;
+
+	entry->desc.limit_low = sizeof(struct tss) - 1;
+	entry->desc.base_low = (unsigned int)tss & 0xFFFF;
+	entry->desc.base_med = ((unsigned int)tss >> 16) & 0xFF;
+	entry->desc.base_high = ((unsigned int)tss >> 24) & 0xFF;
+}
+
+/*
+ * Build the GDT of a processor from the boot one. It is loaded with cpu_lgdt
+ * by the processor itself, or by the trampoline of a starting one (x86.asm).
+ */
+void cpu_gdt_init(unsigned int cpu)
+{
+struct cpu_data *data = &cpu_data[cpu];
+
+	memory_copy(data->gdt, _gdt, sizeof(data->gdt));
+
+	data->gdt[CPU_GDT_INDEX_CPU].desc.limit_low = cpu;
+	cpu_gdt_set_tss(&data->gdt[CPU_GDT_INDEX_TSS_KERNEL], &data->tss);
+	cpu_gdt_set_tss(&data->gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT], &data->double_fault_tss);
+	cpu_gdt_set_tss(&data->gdt[CPU_GDT_INDEX_TSS_PAGE_FAULT], &data->page_fault_tss);
+
+	data->gdt_info.length = sizeof(data->gdt) - 1;
+	data->gdt_info.addr = (uint32_t)data->gdt;
+}
+
+/*
+ * Switch to another page directory. Interrupts must be disabled.
+ * Page faults are handled by a task (see interrupt.c), and a task switch
+ * loads CR3 from the TSS it enters but never saves it in the one it leaves.
+ * So the page fault task must find the directory in use in its TSS, and the
+ * kernel TSS it switches back to must hold the same one.
+ */
+void cpu_mmu_switch(uint32_t page_directory)
+{
+struct cpu_data *data = &cpu_data[cpu_current()];
+
+	_cpu_mmu_switch(page_directory, &data->tss, &data->page_fault_tss);
+}
+
 /**************************
  * General initialization *
  **************************/
@@ -223,6 +284,11 @@ err_t cpu_init(void)
 {
 	memory_clear(&_cpu, sizeof(_cpu));
 
+	/* The boot processor is the first one */
+	cpu_gdt_init(0);
+	cpu_lgdt(&cpu_data[0].gdt_info);
+	cpu_data[0].online = 1;
+
 	/*
 	 * Get CPU capabilities and info.
 	 * First of all, check if the processor supports the CPUID instruction
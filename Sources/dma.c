@@ -14,6 +14,8 @@
 #include <mm.h>
 #include <io.h>
 #include <memory.h>
+#include <cpu.h>
+#include <kernel.h>
 
 #define DMA_CHANNELS	8
 
@@ -36,17 +38,20 @@ static struct dma_port_info {
 	{ 0xD0, 0xC6, 0xC7, 0x8A, 0xD4, 0xD6, 0xD8}
 };
 
-err_t dma_transfer(unsigned channel, void *dest, size_t len, unsigned read_flag)
+/*
+ * Start a transfer to or from a physical address. The controller only reaches
+ * the first 16MB, and cannot cross a DMA page boundary.
+ */
+err_t dma_transfer_physical(unsigned channel, uint32_t addr, size_t len, unsigned read_flag)
 {
-unsigned char *dma_buffer;
-unsigned int addr = (unsigned int)dest;
-
 	// Sanity check
 	if ((channel > DMA_CHANNELS - 1) || channel == 4)
 		return ERROR_INVALID;
 
+	if (!len || (addr + len > MM_ZONE_DMA_END) || (addr + len > DMA_NEXT_BOUNDARY(addr)))
+		return ERROR_INVALID;
+
 	// Setup and start the transfer
-	//memory_copy(dma_buffer, dest, len);
 	port_write_byte(dma_ports[channel].mask, channel | 4);			// Unmask channel
 	port_write_byte(dma_ports[channel].flip_flop, 0);			// Reset flip flop
 	if (read_flag)
@@ -63,6 +68,135 @@ unsigned int addr = (unsigned int)dest;
 	return 0;
 }
 
+err_t dma_transfer(unsigned channel, void *dest, size_t len, unsigned read_flag)
+{
+uint32_t addr;
+
+	// The controller wants the physical address
+	if (mm_map_translate((uint32_t)dest, &addr))
+		return ERROR_INVALID;
+
+	return dma_transfer_physical(channel, addr, len, read_flag);
+}
+
+/*********************
+ * Transfer mappings *
+ *********************/
+
+/* Bytes from buffer on which the controller can work directly, up to len */
+static size_t dma_direct_length(uint32_t buffer, size_t len)
+{
+uint32_t physical, next;
+size_t run, chunk;
+
+	if (mm_map_translate(buffer, &physical) || (physical >= MM_ZONE_DMA_END))
+		return 0;
+
+	// 16MB is on a DMA page boundary, so only the boundary is a limit
+	len = min(len, DMA_NEXT_BOUNDARY(physical) - physical);
+
+	for (run = 0; run < len; run += chunk) {
+		chunk = CPU_PAGE_SIZE - ((buffer + run) & (CPU_PAGE_SIZE - 1));
+
+		if (mm_map_translate(buffer + run, &next) || (next != physical + run))
+			break;
+	}
+
+	return min(run, len);
+}
+
+/*
+ * Prepare a buffer for transfers, splitting it in segments the controller can
+ * work on. Runs of the buffer which are physically contiguous, below 16MB and
+ * within a DMA page are used directly; the rest goes through bounce buffers
+ * from the DMA pool. Segments are cut at multiples of unit (a sector, say),
+ * so a device can be told to transfer whole units for each of them.
+ * If more than DMA_MAP_SEGMENTS segments are needed, only the start of the
+ * buffer is mapped: map->length tells how much.
+ */
+err_t dma_map(struct dma_map *map, void *buffer, size_t len, size_t unit, unsigned read_flag)
+{
+struct dma_segment *segment;
+uint32_t address = (uint32_t)buffer;
+size_t offset, direct, bounce;
+err_t ret;
+
+	map->read_flag = read_flag;
+	map->length = 0;
+	map->count = 0;
+
+	if (!len || !unit)
+		return ERROR_INVALID;
+
+	// Heap and window pages may be only reserved, and the controller does not fault them in
+	if ((address >= MM_AREA_HEAP_START) && (address + len <= MM_AREA_DEVICES_END))
+		return_on_failure(mm_map_commit(address >> 12, size_in_pages((address & (CPU_PAGE_SIZE - 1)) + len)));
+
+	for (offset = 0; (offset < len) && (map->count < DMA_MAP_SEGMENTS); offset += segment->length) {
+		segment = &map->segment[map->count];
+		segment->buffer = (void *)(address + offset);
+		segment->bounce = 0;
+
+		direct = dma_direct_length(address + offset, len - offset);
+		if (direct < len - offset)
+			direct -= direct % unit;
+
+		if (direct) {
+			mm_map_translate(address + offset, &segment->physical);
+			segment->length = direct;
+			map->count++;
+			continue;
+		}
+
+		// Bounce up to where the controller can work on the buffer again
+		bounce = 0;
+		do {
+			bounce += CPU_PAGE_SIZE - ((address + offset + bounce) & (CPU_PAGE_SIZE - 1));
+			bounce = min((bounce + unit - 1) / unit * unit, len - offset);
+			direct = dma_direct_length(address + offset + bounce, len - offset - bounce);
+		} while ((bounce < len - offset) && (bounce + CPU_PAGE_SIZE <= DMA_BOUNCE_SIZE) &&
+			(direct < min(unit, len - offset - bounce)));
+
+		ret = mm_dma_allocate(bounce, &segment->bounce);
+		if (ret) {
+			dma_unmap(map);
+			return ret;
+		}
+
+		mm_map_translate((uint32_t)segment->bounce, &segment->physical);
+		segment->length = bounce;
+		map->count++;
+
+		if (!read_flag)
+			memory_copy(segment->bounce, segment->buffer, bounce);
+	}
+
+	map->length = offset;
+
+	return 0;
+}
+
+/* Finish the transfers of a map, copying what was read into the bounce buffers */
+void dma_unmap(struct dma_map *map)
+{
+struct dma_segment *segment;
+unsigned int i;
+
+	for (i = 0; i < map->count; i++) {
+		segment = &map->segment[i];
+		if (!segment->bounce)
+			continue;
+
+		if (map->read_flag)
+			memory_copy(segment->buffer, segment->bounce, segment->length);
+
+		mm_dma_free(segment->bounce);
+	}
+
+	map->count = 0;
+	map->length = 0;
+}
+
 err_t dma_init(void)
 {
 	return 0;
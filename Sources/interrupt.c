@@ -18,6 +18,10 @@
 #include <string.h>
 #include <console.h>
 #include <mm.h>
+#include <process.h>
+#include <lock.h>
+#include <kernel.h>
+#include <smp.h>
 
 /* From x86.asm */
 extern void _int0_handler(void);
@@ -55,10 +59,9 @@ extern void _irq14_handler(void);
 extern void _irq15_handler(void);
 extern void _syscall_misc_trap(void);
 extern void interrupt_lidt(struct idt_info *_idt_info);
-extern union dt_entry _gdt[];
-extern struct tss _double_fault_tss;
+extern void _double_fault_handler(void);
+extern void _page_fault_handler(void);
 extern void _process_page_directory;
-extern void _dummy_page_directory;
 
 /* From start.asm */
 extern void _freeze(void);
@@ -84,6 +87,10 @@ static struct {
  */
 void interrupt_trap_exception(unsigned number, uint32_t error_code, uint32_t address, uint16_t selector, uint32_t eip)
 {
+	/* Page faults on reserved memory are resolved by the memory manager */
+	if ((number == 14) && !mm_map_fault(address, error_code))
+		return;
+
 	if (number == -1)
 		console_write_formatted("\nUnhandled exception @ %#.2X:%.8X: error code %.8X, CR2 %#.8X\n", 
 			number, selector, eip, error_code, address);
@@ -94,6 +101,30 @@ void interrupt_trap_exception(unsigned number, uint32_t error_code, uint32_t add
 	_freeze();
 }
 
+/*
+ * Page fault handler.
+ * The processor calls it with a task switch (see interrupt_init_pagefault),
+ * and the state of the faulting task is saved in the kernel TSS. So a fault
+ * is handled on a stack of its own even when it was taken on a ring 0 stack
+ * which has no room left, as when a thread stack grows into a reserved page.
+ */
+void interrupt_trap_page(uint32_t error_code)
+{
+struct tss *tss = &cpu_data[cpu_current()].tss;
+uint32_t address;
+int locked;
+
+	address = cpu_mmu_fault_address();
+
+	/* The faulting code may hold the interrupt lock already, or have interrupts disabled on this processor only */
+	locked = interrupt_lock();
+
+	interrupt_trap_exception(14, error_code, address, tss->cs, tss->eip);
+
+	if (locked)
+		interrupt_unlock();
+}
+
 /*
  * Trap an Interrupt ReQuest
  */
@@ -113,13 +144,20 @@ char buf[64];
 
 /*
  * Double fault handler.
- * The processor calls it on with a task switch.
+ * The processor calls it on with a task switch, and the state of the faulting
+ * task is saved in the kernel TSS. The faulting instruction cannot be resumed,
+ * so this is always the end.
  */
-static void interrupt_trap_doublefault(void)
+void interrupt_trap_doublefault(void)
 {
+struct tss *tss;
+
 	interrupt_disable();
 
-	console_write("\nDouble fault! This is really bad!\n");
+	tss = &cpu_data[cpu_current()].tss;
+
+	console_write_formatted("\nDouble fault @ %#.2X:%.8X, ESP %.8X, CR2 %#.8X. This is really bad!\n",
+		tss->cs, tss->eip, tss->esp, cpu_mmu_fault_address());
 
 	_freeze();
 	
@@ -216,48 +254,126 @@ err_t interrupt_irq_disable(uint8_t number)
 }
 
 
+/******************
+ * Interrupt lock *
+ ******************/
+
+/*
+ * The kernel keeps its data consistent by disabling interrupts, which keeps
+ * out the other threads of the processor but not the other processors. So a
+ * processor disabling interrupts also takes the interrupt lock, and leaves
+ * it when it enables them again: the regions running with interrupts
+ * disabled exclude each other on all the processors, as they did on one.
+ * The handlers (x86.asm) take it on entry, unless the code they interrupted
+ * holds it, and leave it when they return to code with interrupts enabled.
+ */
+
+static spinlock_t interrupt_lock_word = SPINLOCK_INITIALIZER;
+static volatile unsigned int interrupt_lock_owner = -1;	/* Processor holding the lock */
+
+/*
+ * Take the interrupt lock, unless this processor holds it already. Interrupts
+ * must be disabled. Returns 1 if it was taken now.
+ */
+int interrupt_lock(void)
+{
+unsigned int cpu = cpu_current();
+
+	if (interrupt_lock_owner == cpu)
+		return 0;
+
+	// The holder may be waiting for this processor to flush its TLB
+	while (!lock_try(&interrupt_lock_word))
+		smp_tlb_poll();
+
+	interrupt_lock_owner = cpu;
+
+	return 1;
+}
+
+void interrupt_unlock(void)
+{
+	if (interrupt_lock_owner != cpu_current())
+		return;
+
+	interrupt_lock_owner = -1;
+	lock_release(&interrupt_lock_word);
+}
+
+
 /******************
  * Initialization *
  ******************/
 
-/* Initialize the double fault handler */
-err_t interrupt_init_doublefault(void)
+/* Set up the double fault task of a processor. Its descriptor is set by cpu_gdt_init */
+err_t interrupt_init_doublefault(unsigned int cpu)
 {
+struct tss *tss = &cpu_data[cpu].double_fault_tss;
+
 	if (mm_ppage_get_free() < 1)
 		return ERROR_NO_MEMORY;
 
-	/* Set up the descriptor */
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.type = CPU_GDT_TYPE_TASK;
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.access = CPU_GDT_ACCESS_PRESENT | CPU_GDT_ACCESS_DPL_0;
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.flags = CPU_GDT_FLAG_AVAILABLE;
-
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.limit_low = sizeof(struct tss) - 1;
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.base_low = (unsigned int)&_double_fault_tss & 0xFFFF;
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.base_med = ((unsigned int)&_double_fault_tss >> 16) & 0xFF;
-	_gdt[CPU_GDT_INDEX_TSS_DOUBLE_FAULT].desc.base_high = ((unsigned int)&_double_fault_tss >> 24) & 0xFF;
-
 	/* Set up the TSS */
-	memory_clear(&_double_fault_tss, sizeof(struct tss));
-
-	_double_fault_tss.eip = (uint32_t)&interrupt_trap_doublefault;
-	_double_fault_tss.cs = CPU_GDT_INDEX_KERNEL_CS * sizeof(union dt_entry);
-	_double_fault_tss.ds = _double_fault_tss.es =_double_fault_tss.fs = _double_fault_tss.ss = 
-		_double_fault_tss.ss0 = CPU_GDT_INDEX_KERNEL_DS * sizeof(union dt_entry);
-	_double_fault_tss.esp = _double_fault_tss.esp0 = (uint32_t)mm_heap_allocate_aligned(4, 4096) + 4096;
-	_double_fault_tss.eflags = 0x200;
+	memory_clear(tss, sizeof(struct tss));
+
+	tss->eip = (uint32_t)&_double_fault_handler;
+	tss->cs = CPU_GDT_INDEX_KERNEL_CS * sizeof(union dt_entry);
+	tss->ds = tss->es = tss->fs = tss->ss = 
+		tss->ss0 = CPU_GDT_INDEX_KERNEL_DS * sizeof(union dt_entry);
+	tss->esp = (uint32_t)mm_heap_allocate_aligned(CPU_PAGE_SIZE, CPU_PAGE_SIZE);
+	if (!tss->esp)
+		return ERROR_NO_MEMORY;
+
+	/* Exactly one page, which must be there before the double fault */
+	return_on_failure(mm_map_commit(tss->esp >> 12, 1));
+	tss->esp = tss->esp0 = tss->esp + CPU_PAGE_SIZE;
+	tss->eflags = 0x002;
 	
-	// Setup its page directory
-	mm_ppage_pop(&_double_fault_tss.cr3, 1);
-	mm_map_page_directory(_double_fault_tss.cr3);
-	memory_clear(&_dummy_page_directory, CPU_PAGE_SIZE);
-	memory_copy(&_dummy_page_directory, &_process_page_directory, (MM_AREA_KERNEL_END / 0x400000) * sizeof(uint32_t));
+	// Use the kernel page directory, which is the only one always having every kernel page table
+	tss->cr3 = (uint32_t)&_process_page_directory;
 
-	/* Set up the interrupt handler */
-	interrupt_set_task(8, CPU_GDT_INDEX_TSS_DOUBLE_FAULT * sizeof(union dt_entry), CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+	return 0;
+}
+
+/*
+ * Set up the page fault task of a processor. Its descriptor is set by
+ * cpu_gdt_init. It runs with interrupts disabled, in the space which took the
+ * fault: cpu_mmu_switch keeps its CR3 up to date.
+ */
+err_t interrupt_init_pagefault(unsigned int cpu)
+{
+struct tss *tss = &cpu_data[cpu].page_fault_tss;
+
+	memory_clear(tss, sizeof(struct tss));
+
+	tss->eip = (uint32_t)&_page_fault_handler;
+	tss->cs = CPU_GDT_INDEX_KERNEL_CS * sizeof(union dt_entry);
+	tss->ds = tss->es = tss->fs = tss->ss = 
+		tss->ss0 = CPU_GDT_INDEX_KERNEL_DS * sizeof(union dt_entry);
+	tss->esp = (uint32_t)mm_heap_allocate_aligned(CPU_PAGE_SIZE, CPU_PAGE_SIZE);
+	if (!tss->esp)
+		return ERROR_NO_MEMORY;
+
+	/* A fault on this stack could not be handled */
+	return_on_failure(mm_map_commit(tss->esp >> 12, 1));
+	tss->esp = tss->esp0 = tss->esp + CPU_PAGE_SIZE;
+	tss->eflags = 0x002;
+	tss->cr3 = (uint32_t)&_process_page_directory;
 
 	return 0;
 }
 
+/*
+ * Send double faults and page faults to the tasks of each processor. Every
+ * processor must have them set up, and its task register loaded, before it
+ * can take a page fault (see process_init_tss).
+ */
+void interrupt_init_tasks(void)
+{
+	interrupt_set_task(8, CPU_GDT_INDEX_TSS_DOUBLE_FAULT * sizeof(union dt_entry), CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+	interrupt_set_task(14, CPU_GDT_INDEX_TSS_PAGE_FAULT * sizeof(union dt_entry), CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+}
+
 void interrupt_init_syscalls(void)
 {
 #define TRAP_FLAGS 	(CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_3)
@@ -297,7 +413,7 @@ unsigned i;
 	interrupt_set_handler(11, _int11_handler, FLAGS);	/* Segment not present */
 	interrupt_set_handler(12, _int12_handler, FLAGS);	/* Stack exception */
 	interrupt_set_handler(13, _int13_handler, FLAGS);	/* General protection fault */
-	interrupt_set_handler(14, _int14_handler, FLAGS);	/* Page fault */
+	interrupt_set_handler(14, _int14_handler, FLAGS);	/* Page fault, until interrupt_init_tasks */
 	interrupt_set_handler(15, _int_unhandled, FLAGS);
 	interrupt_set_handler(16, _int16_handler, FLAGS);	/* Coprocessor error */
 	interrupt_set_handler(17, _int17_handler, FLAGS);	/* Alignment check */
@@ -362,3 +478,9 @@ unsigned i;
 
 	return 0;
 }
+
+/* Load the IDT on a processor started after boot. All of them share it */
+void interrupt_init_cpu(void)
+{
+	interrupt_lidt(&_idt_info);
+}
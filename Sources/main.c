@@ -21,8 +21,8 @@
 #include <multiboot.h>
 #include <elf.h>
 #include <memory.h>
+#include <smp.h>
 
-extern void _dummy_page_directory, _process_page_directory;
 extern struct process *kernel_process;
 
 
@@ -31,7 +31,8 @@ static void shell_loader(void)
 void *shell_handle;
 Elf32_Ehdr header;
 Elf32_Phdr program_header;
-unsigned int pos, flags;
+unsigned int pos, protection, padding;
+uint32_t start, pages;
 
 	if (ext2_open("/system/shell.x", &shell_handle)) {
 		console_write("Cannot open the shell executable\n");
@@ -54,27 +55,46 @@ unsigned int pos, flags;
 		if (!(program_header.p_type == PT_LOAD))
 			goto next;
 		
-		flags = (program_header.p_flags & PF_W ? CPU_PAGE_FLAG_WRITABLE : 0);
-		flags |= CPU_PAGE_FLAG_USER;
+		protection = MM_VMA_READ;
+		protection |= (program_header.p_flags & PF_W ? MM_VMA_WRITE : 0);
+		protection |= (program_header.p_flags & PF_X ? MM_VMA_EXECUTE : 0);
 		
-		// Allocate page if not present
-		if (mm_map_check(program_header.p_vaddr >> CPU_PAGE_SHIFT)) 
-			mm_map(program_header.p_vaddr >> CPU_PAGE_SHIFT, size_in_pages(program_header.p_memsz), flags);
+		// Create the memory area. Only the pages touched by the copy are allocated now, the others on first use.
+		// It is writable until loaded, since the kernel faults on read-only pages too
+		start = program_header.p_vaddr >> CPU_PAGE_SHIFT;
+		pages = size_in_pages(program_header.p_vaddr + program_header.p_memsz) - start;
+
+		// The segment may begin in the last page of the previous one
+		if (pages && mm_vma_find(current_process->vmas, start)) {
+			start++;
+			pages--;
+		}
+
+		if (pages)
+			mm_vma_map(&current_process->vmas, start, pages, MM_VMA_READ | MM_VMA_WRITE, MM_VMA_ANONYMOUS, 0, 0);
 		
 		// Copy the file data to memory, if any
 		if (program_header.p_filesz) 
 			ext2_read(shell_handle, (void *)program_header.p_vaddr, program_header.p_offset, program_header.p_filesz);
 
-		// Clear the padding (the difference between size in memory and size in file)			
-		memory_clear((void *)(program_header.p_vaddr + program_header.p_filesz), program_header.p_memsz - program_header.p_filesz);
+		// Clear the padding (the difference between size in memory and size in file). Reserved pages come
+		// cleared, so only the rest of the page holding the end of the file data needs it
+		padding = min(program_header.p_memsz - program_header.p_filesz,
+			CPU_PAGE_SIZE - ((program_header.p_vaddr + program_header.p_filesz) & 0xFFF));
+		if (program_header.p_filesz)
+			memory_clear((void *)(program_header.p_vaddr + program_header.p_filesz), padding);
+
+		if (pages && !(protection & MM_VMA_WRITE))
+			mm_vma_protect(&current_process->vmas, start, pages, protection);
 		
 	next:
 		pos += sizeof(Elf32_Phdr);
 		
 	}
 	
-	// Allocate the user stack
-	mm_map(0xFFFFF, 1, CPU_PAGE_FLAG_USER | CPU_PAGE_FLAG_WRITABLE);
+	// Create the user stack, which grows down from the end of the address space
+	mm_vma_map(&current_process->vmas, 0x100000 - MM_USER_STACK_PAGES, MM_USER_STACK_PAGES, MM_VMA_READ | MM_VMA_WRITE,
+		MM_VMA_STACK, MM_VMA_GROWS_DOWN, 0);
 		
 	ext2_close(shell_handle);
 	
@@ -98,6 +118,7 @@ static struct boot_module first_stage_module[] = {
 #define first_stage_module_count		(sizeof(first_stage_module) / sizeof(struct boot_module))
 
 static struct boot_module system_module[] = {
+	{ smp_init, "Processors" },
 	{ keyboard_init, "Keyboard driver" },
 	{ fdc_init, "Floppy disk driver" },
 	{ ata_init, "ATA/ATAPI disk driver" },
@@ -165,7 +186,7 @@ struct process *shell;
 	if (mm_ppage_get_free() < 1)
 		goto fail;
 
-	shell = (struct process *)mm_heap_allocate(sizeof(struct process));
+	shell = (struct process *)mm_slab_allocate(&process_cache);
 	if (!shell)
 		goto fail;
 	memory_clear(shell, sizeof(struct process));
@@ -176,41 +197,23 @@ struct process *shell;
 	
 	// Create process loading thread
 	if (process_thread_create(shell, priorityNormal, (uint32_t)shell_loader, PROCESS_THREAD_STACK_DEFAULT)) {
-		mm_heap_free(shell);
+		mm_slab_free(&process_cache, shell);
 		goto fail;
 	}
 	
-	interrupt_disable();
-	
 	// Initialize process memory
-	mm_ppage_pop(&shell->page_directory, 1);
-	mm_map_page_directory(shell->page_directory);
-	memory_clear(&_dummy_page_directory, CPU_PAGE_SIZE);
-	memory_copy(&_dummy_page_directory, &_process_page_directory, (MM_AREA_KERNEL_END / 0x400000) * sizeof(uint32_t));
-	
-	// Map the page directory itself at 0x02000000
-	{
-	uint32_t *page_dir;
-	
-		page_dir = (uint32_t *)&_dummy_page_directory;
-		page_dir[0x02000000 >> 22] = shell->page_directory | 0x3;
-	}
-	
-	// Map the process page directory on the page directory access window
-	{
-	uint32_t page_table;
-	uint32_t *table;
-	
-		page_table = (uint32_t)( ((uint32_t *)&_dummy_page_directory)[(uint32_t)&_process_page_directory >> 22] & 0xFFFFF000 );
-		mm_map_page_directory(page_table);
-		table = (uint32_t *)&_dummy_page_directory;
-		table[((uint32_t)&_process_page_directory >> 12) & 0x3FF] = shell->page_directory | 0x3;
-	}
+	if (mm_space_create(&shell->page_directory))
+		goto fail;
+
+	interrupt_disable();
 	
 	// Put the process in the process list
 	process_list->previous = shell;
 	shell->next = process_list;
 	process_list = shell;
+
+	// Its loading thread can run now
+	process_schedule_enqueue(shell->thread_list);
 	
 	total_processes++;
 	
@@ -0,0 +1,398 @@
+/*
+ * smp.c
+ * Written by The Neuromancer <neuromancer at paranoici dot org>
+ *
+ * This file is part of the Klesh operating system.
+ * Make sure you have read the license before copying, reading or
+ * modifying this document.
+ *
+ * Initial release: 2026-10-17
+ */
+
+/*
+ * Multiprocessor support.
+ *
+ * The processors are found in the MADT of ACPI, or else in the configuration
+ * table of the MultiProcessor Specification. Each of the others is started
+ * with an INIT and two STARTUP interrupts, which make it run the trampoline
+ * (x86.asm) in real mode from a page below 1MB. It loads the GDT prepared
+ * for it, turns on paging with the kernel page directory, and calls
+ * smp_start on its own stack, which sets up the IDT, the TSS, the local APIC
+ * and the idle thread of the processor and starts scheduling.
+ *
+ * Page table changes are flushed from the other TLBs by an interrupt to
+ * every other processor, waiting until all of them are done. It is sent with
+ * the interrupt lock held, so only one request is ever pending; a processor
+ * waiting for the lock polls for it instead (see interrupt.c).
+ */
+
+#include <smp.h>
+#include <apic.h>
+#include <cpu.h>
+#include <mm.h>
+#include <memory.h>
+#include <process.h>
+#include <interrupt.h>
+#include <kernel.h>
+#include <console.h>
+
+/* From x86.asm */
+extern void _smp_trampoline(void);
+extern void _smp_trampoline_end(void);
+extern struct gdt_info _smp_trampoline_gdt;
+extern void _smp_reschedule_handler(void);
+extern void _smp_tlb_handler(void);
+extern uint32_t _process_page_directory[1024];
+extern void process_ltr(uint16_t descriptor);
+
+/* From interrupt.c */
+extern void interrupt_set_handler(uint8_t number, void (*function)(void), unsigned access);
+
+unsigned int smp_cpus = 1;
+
+/* Read by the trampoline of the starting processor */
+uint32_t smp_boot_cr3, smp_boot_cr4, smp_boot_stack;
+
+/* APIC IDs of the processors found, the boot one included */
+static unsigned int smp_apic_id[CPU_MAX];
+static unsigned int smp_found;
+
+static struct mm_tlb_gather smp_tlb_request;
+static volatile unsigned int smp_tlb_pending[CPU_MAX];
+
+/*************
+ * Discovery *
+ *************/
+
+static unsigned int smp_checksum(void *data, size_t length)
+{
+uint8_t *byte = (uint8_t *)data, sum = 0;
+
+	while (length--)
+		sum += *byte++;
+
+	return sum;
+}
+
+/* Whether data starts with the length bytes of signature */
+static unsigned int smp_signature(void *data, unsigned char *signature, size_t length)
+{
+uint8_t *byte = (uint8_t *)data;
+
+	while (length--)
+		if (*byte++ != *signature++)
+			return 0;
+
+	return 1;
+}
+
+/* Find a structure on a 16 byte boundary of low memory, which is identity mapped */
+static void *smp_scan(uint32_t start, size_t length, unsigned char *signature, size_t checked)
+{
+uint32_t address;
+
+	for (address = start & ~15; address + checked <= start + length; address += 16)
+		if (smp_signature((void *)address, signature, 4) && !smp_checksum((void *)address, checked))
+			return (void *)address;
+
+	return 0;
+}
+
+static void smp_cpu_add(unsigned int apic_id)
+{
+	if (smp_found < CPU_MAX)
+		smp_apic_id[smp_found++] = apic_id;
+}
+
+/* Map a table of the firmware with its 4 byte signature. length_size is the size of the length after it */
+static err_t smp_table_map(uint32_t physical, unsigned char *signature, size_t length_size, void **table)
+{
+uint32_t length;
+void *header;
+
+	return_on_failure(mm_ioremap(physical, 8, 0, &header));
+
+	length = (length_size == 2) ? *(uint16_t *)((uint8_t *)header + 4) : *(uint32_t *)((uint8_t *)header + 4);
+	if (!smp_signature(header, signature, 4) || (length < 8)) {
+		mm_vfree(header);
+		return ERROR_NOT_FOUND;
+	}
+
+	mm_vfree(header);
+
+	return_on_failure(mm_ioremap(physical, length, 0, table));
+
+	if (smp_checksum(*table, length)) {
+		mm_vfree(*table);
+		return ERROR_INVALID;
+	}
+
+	return 0;
+}
+
+static err_t smp_acpi_find(void)
+{
+struct smp_acpi_rsdp *rsdp;
+struct smp_acpi_header *rsdt;
+struct smp_acpi_madt *madt;
+struct smp_acpi_madt_lapic *lapic;
+uint32_t ebda, *entry;
+uint8_t *next, *end;
+unsigned int i;
+
+	ebda = *(uint16_t *)SMP_BIOS_EBDA_SEGMENT << 4;
+
+	rsdp = smp_scan(ebda, 1024, SMP_ACPI_RSDP_SIGNATURE, sizeof(struct smp_acpi_rsdp));
+	if (!rsdp)
+		rsdp = smp_scan(0xE0000, 0x20000, SMP_ACPI_RSDP_SIGNATURE, sizeof(struct smp_acpi_rsdp));
+
+	// Only the first four bytes were compared
+	if (!rsdp || !smp_signature(rsdp->signature, SMP_ACPI_RSDP_SIGNATURE, 8))
+		return ERROR_NOT_FOUND;
+
+	return_on_failure(smp_table_map(rsdp->rsdt, "RSDT", 4, (void **)&rsdt));
+
+	entry = (uint32_t *)(rsdt + 1);
+	for (i = 0; i < (rsdt->length - sizeof(struct smp_acpi_header)) / 4; i++) {
+		if (smp_table_map(entry[i], SMP_ACPI_MADT_SIGNATURE, 4, (void **)&madt))
+			continue;
+
+		end = (uint8_t *)madt + madt->header.length;
+		for (next = (uint8_t *)(madt + 1); next + 2 <= end; next += next[1]) {
+			if (next[1] < 2)
+				break;
+
+			lapic = (struct smp_acpi_madt_lapic *)next;
+			if ((lapic->type == SMP_ACPI_MADT_LAPIC) && (lapic->flags & SMP_ACPI_LAPIC_ENABLED))
+				smp_cpu_add(lapic->apic_id);
+		}
+
+		mm_vfree(madt);
+		break;
+	}
+
+	mm_vfree(rsdt);
+
+	return smp_found ? 0 : ERROR_NOT_FOUND;
+}
+
+static err_t smp_mp_find(void)
+{
+struct smp_mp_floating *floating;
+struct smp_mp_table *table;
+struct smp_mp_processor *processor;
+uint32_t ebda, base;
+uint8_t *entry, *end;
+unsigned int i;
+
+	ebda = *(uint16_t *)SMP_BIOS_EBDA_SEGMENT << 4;
+	base = *(uint16_t *)SMP_BIOS_BASE_MEMORY << 10;
+
+	floating = smp_scan(ebda, 1024, SMP_MP_FLOATING_SIGNATURE, sizeof(struct smp_mp_floating));
+	if (!floating)
+		floating = smp_scan(base - 1024, 1024, SMP_MP_FLOATING_SIGNATURE, sizeof(struct smp_mp_floating));
+	if (!floating)
+		floating = smp_scan(0xF0000, 0x10000, SMP_MP_FLOATING_SIGNATURE, sizeof(struct smp_mp_floating));
+
+	/* The default configurations, without a table, are not supported */
+	if (!floating || !floating->table)
+		return ERROR_NOT_FOUND;
+
+	return_on_failure(smp_table_map(floating->table, SMP_MP_TABLE_SIGNATURE, 2, (void **)&table));
+
+	entry = (uint8_t *)(table + 1);
+	end = (uint8_t *)table + table->length;
+
+	for (i = 0; (i < table->entries) && (entry < end); i++) {
+		if (*entry != SMP_MP_ENTRY_PROCESSOR) {
+			entry += 8;
+			continue;
+		}
+
+		processor = (struct smp_mp_processor *)entry;
+		if (processor->flags & SMP_MP_PROCESSOR_ENABLED)
+			smp_cpu_add(processor->apic_id);
+
+		entry += sizeof(struct smp_mp_processor);
+	}
+
+	mm_vfree(table);
+
+	return smp_found ? 0 : ERROR_NOT_FOUND;
+}
+
+/*****************************
+ * Interprocessor interrupts *
+ *****************************/
+
+/* Wake up a processor, so that it looks at the ready queues */
+void smp_reschedule(unsigned int cpu)
+{
+	if ((cpu == cpu_current()) || !cpu_data[cpu].online || !apic_registers)
+		return;
+
+	apic_ipi(cpu_data[cpu].apic_id, APIC_ICR_FIXED | APIC_VECTOR_RESCHEDULE);
+}
+
+/* Invalidate the pages of a gather on every processor. Called by mm_tlb_gather_flush */
+void smp_tlb_shootdown(struct mm_tlb_gather *tlb)
+{
+unsigned int self, cpu;
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	self = cpu_current();
+	mm_tlb_flush_local(tlb);
+
+	/* The boot processor is the only one online until smp_init starts the others */
+	smp_tlb_request = *tlb;
+
+	for (cpu = 0; cpu < CPU_MAX; cpu++)
+		if ((cpu != self) && cpu_data[cpu].online) {
+			smp_tlb_pending[cpu] = 1;
+			apic_ipi(cpu_data[cpu].apic_id, APIC_ICR_FIXED | APIC_VECTOR_TLB);
+		}
+
+	for (cpu = 0; cpu < CPU_MAX; cpu++)
+		while (smp_tlb_pending[cpu])
+			;
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/* Carry out the flush requested to this processor, if any. Interrupts must be disabled */
+void smp_tlb_poll(void)
+{
+unsigned int cpu = cpu_current();
+
+	if (!smp_tlb_pending[cpu])
+		return;
+
+	mm_tlb_flush_local(&smp_tlb_request);
+	smp_tlb_pending[cpu] = 0;
+}
+
+/***********
+ * Startup *
+ ***********/
+
+/* Start the other processors. They need the local APIC and its timer */
+err_t smp_init(void)
+{
+struct gdt_info *gdt;
+unsigned int i, cpu, wait;
+void *trampoline, *stack;
+uint32_t page;
+
+	if (!apic_registers || !apic_timer_max)
+		return ERROR_NOT_AVAILABLE;
+
+	if (smp_acpi_find() && smp_mp_find())
+		return ERROR_NOT_FOUND;
+
+	if (smp_found < 2)
+		return 0;
+
+	/* Pool buffers below 1MB are identity mapped, so the address is the physical one too */
+	return_on_failure(mm_dma_allocate_aligned(CPU_PAGE_SIZE, CPU_PAGE_SIZE, &trampoline));
+	page = (uint32_t)trampoline;
+	if (page >= 0x100000) {
+		mm_dma_free(trampoline);
+		return ERROR_NO_MEMORY;
+	}
+
+	memory_copy(trampoline, _smp_trampoline, (uint32_t)_smp_trampoline_end - (uint32_t)_smp_trampoline);
+	gdt = (struct gdt_info *)(page + ((uint32_t)&_smp_trampoline_gdt - (uint32_t)_smp_trampoline));
+
+	interrupt_set_handler(APIC_VECTOR_RESCHEDULE, _smp_reschedule_handler, CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+	interrupt_set_handler(APIC_VECTOR_TLB, _smp_tlb_handler, CPU_IDT_ACCESS_PRESENT | CPU_IDT_ACCESS_DPL_0);
+
+	/* Paging is turned on as mm_init did on the boot processor */
+	smp_boot_cr3 = (uint32_t)_process_page_directory;
+	smp_boot_cr4 = 0;
+	if (_cpu.capabilities & CPU_CAPABILITY_PSE)
+		smp_boot_cr4 |= 0x10;
+	if (_cpu.capabilities & CPU_CAPABILITY_GLOBALPAGES)
+		smp_boot_cr4 |= 0x80;
+
+	/*
+	 * The trampoline has room for a single GDT and stack. A processor which
+	 * did not answer in time could still come up later and use them, so no
+	 * other one is started after it.
+	 */
+	cpu = 1;
+	for (i = 0; (i < smp_found) && (cpu < CPU_MAX); i++) {
+		if (smp_apic_id[i] == cpu_data[0].apic_id)
+			continue;
+
+		if (mm_vstack(PROCESS_THREAD_STACK_DEFAULT, &stack))
+			break;
+
+		/* The trampoline runs on it before page faults can be handled */
+		if (mm_map_commit((uint32_t)stack >> 12, size_in_pages(PROCESS_THREAD_STACK_DEFAULT))) {
+			mm_vfree(stack);
+			break;
+		}
+
+		cpu_gdt_init(cpu);
+		if (process_init_tss(cpu)) {
+			mm_vfree(stack);
+			break;
+		}
+
+		cpu_data[cpu].apic_id = smp_apic_id[i];
+		*gdt = cpu_data[cpu].gdt_info;
+		smp_boot_stack = (uint32_t)stack + PROCESS_THREAD_STACK_DEFAULT;
+
+		apic_ipi(smp_apic_id[i], APIC_ICR_INIT | APIC_ICR_TRIGGER_LEVEL | APIC_ICR_LEVEL_ASSERT);
+		apic_ipi(smp_apic_id[i], APIC_ICR_INIT | APIC_ICR_TRIGGER_LEVEL);
+		delay(10);
+		apic_ipi(smp_apic_id[i], APIC_ICR_STARTUP | (page >> 12));
+		delay(1);
+		if (!cpu_data[cpu].online)
+			apic_ipi(smp_apic_id[i], APIC_ICR_STARTUP | (page >> 12));
+
+		for (wait = 0; !cpu_data[cpu].online && (wait < SMP_START_TIMEOUT); wait++)
+			delay(1);
+
+		/* Its stack, GDT and index are left to it */
+		if (!cpu_data[cpu].online) {
+			console_write_formatted("SMP: processor %u did not start\n", smp_apic_id[i]);
+			break;
+		}
+
+		smp_cpus++;
+		cpu++;
+	}
+
+	return 0;
+}
+
+/* Entered by the trampoline on a starting processor, with interrupts disabled */
+void smp_start(void)
+{
+unsigned int cpu = cpu_current();
+
+	/* Its tasks are ready (see smp_init), and nothing may fault before this */
+	process_ltr(CPU_GDT_INDEX_TSS_KERNEL * sizeof(union dt_entry));
+
+	cpu_data[cpu].online = 1;
+
+	/* From now on it is sent the TLB flushes, but what it cached before may be stale */
+	if (_cpu.capabilities & CPU_CAPABILITY_GLOBALPAGES)
+		cpu_mmu_flush_global();
+	else
+		cpu_mmu_flush();
+
+	interrupt_init_cpu();
+	process_init_cpu();
+	apic_init_cpu();
+	apic_timer_periodic();
+
+	interrupt_enable();
+
+	process_thread_idle();
+}
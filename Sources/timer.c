@@ -12,24 +12,371 @@
 
 #include <timer.h>
 #include <io.h>
+#include <cpu.h>
+#include <interrupt.h>
+#include <process.h>
+#include <apic.h>
+#include <smp.h>
 
-err_t timer_init(void)
+/*
+ * Hierarchical timer wheel.
+ *
+ * Level 0 has a slot for each of the next TIMER_WHEEL_SLOTS ticks, and every
+ * further level has slots TIMER_WHEEL_SLOTS times as long, so adding and
+ * cancelling a timer are constant time whatever its delay. When level 0
+ * wraps around, the timers of the next slot of level 1 are spread over level
+ * 0 (and the same for the higher levels when level 1 wraps), so a timer is
+ * moved at most once per level before it expires.
+ */
+
+static struct timer *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static unsigned int timer_ticks;	/* Next tick to run: every timer before it has expired */
+static struct timer *timer_expired;	/* Timers of the tick being run */
+
+static void timer_link(struct timer *timer)
+{
+unsigned int delta, expires, level;
+
+	expires = timer->expires;
+	delta = expires - timer_ticks;
+
+	// Already expired, so it runs with the next tick
+	if ((int)delta < 0) {
+		expires = timer_ticks;
+		delta = 0;
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+		if (delta < (1 << ((level + 1) * TIMER_WHEEL_BITS)))
+			break;
+
+	// Too far: it waits in the last slot of the wheel, and is put back there until near enough
+	if (delta >= (1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)))
+		expires = timer_ticks + (1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+
+	timer->slot = &timer_wheel[level][(expires >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1)];
+	timer->previous = 0;
+	timer->next = *timer->slot;
+	if (timer->next)
+		timer->next->previous = timer;
+	*timer->slot = timer;
+}
+
+static void timer_unlink(struct timer *timer)
+{
+	if (timer->previous)
+		timer->previous->next = timer->next;
+	else
+		*timer->slot = timer->next;
+	if (timer->next)
+		timer->next->previous = timer->previous;
+
+	timer->slot = 0;
+}
+
+/* Spread the timers of a slot over the lower levels */
+static void timer_cascade(unsigned int level, unsigned int slot)
+{
+struct timer *timer, *next;
+
+	timer = timer_wheel[level][slot];
+	timer_wheel[level][slot] = 0;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+		timer_link(timer);
+	}
+}
+
+void timer_setup(struct timer *timer, void (*function)(void *data), void *data)
+{
+	timer->function = function;
+	timer->data = data;
+	timer->slot = 0;
+}
+
+/* Start a timer, or move it if pending, to expire ticks from now */
+void timer_add(struct timer *timer, unsigned int ticks)
+{
+uint32_t eflags;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	if (timer->slot)
+		timer_unlink(timer);
+
+	timer->expires = _ticks + ticks;
+	timer_link(timer);
+
+	// The wheel is run by the boot processor, which may be idle with its tick stopped
+	if (cpu_current() && (process_cpu_thread[0] == process_cpu_idle[0]))
+		smp_reschedule(0);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+}
+
+/* Stop a timer. Returns 1 if it was pending, 0 if it had expired or was never added */
+int timer_cancel(struct timer *timer)
+{
+uint32_t eflags;
+int pending;
+
+	eflags = cpu_flags_get();
+	interrupt_disable();
+
+	pending = (timer->slot != 0);
+	if (pending)
+		timer_unlink(timer);
+
+	if (eflags & CPU_FLAG_INTERRUPT)
+		interrupt_enable();
+
+	return pending;
+}
+
+/* Run the timers expired up to _ticks */
+static void timer_run(void)
+{
+struct timer *timer;
+unsigned int index, level, slot;
+
+	while ((int)(_ticks - timer_ticks) >= 0) {
+		index = timer_ticks & (TIMER_WHEEL_SLOTS - 1);
+
+		// Level 0 has wrapped around, so bring the next slot of the level above down
+		if (!index)
+			for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				slot = (timer_ticks >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+				timer_cascade(level, slot);
+				if (slot)
+					break;
+			}
+
+		// Timers added by the functions from now on expire with the next tick at the earliest
+		timer_ticks++;
+
+		// Run them from a list of their own, which the functions cannot add to
+		timer_expired = timer_wheel[0][index];
+		timer_wheel[0][index] = 0;
+		for (timer = timer_expired; timer; timer = timer->next)
+			timer->slot = &timer_expired;
+
+		while ((timer = timer_expired)) {
+			timer_unlink(timer);
+			timer->function(timer->data);
+		}
+	}
+}
+
+/**********
+ * Clocks *
+ **********/
+
+/* Use the local APIC timer when there is one. Only read by timer_init */
+unsigned int timer_apic_enable = 1;
+
+static unsigned int timer_apic;			/* The local APIC timer is used instead of the PIT */
+static unsigned int timer_oneshot_max;		/* Longest one-shot of the clock, in ticks */
+
+static void timer_program(unsigned int mode, uint16_t value)
+{
+	port_write_byte(TIMER_8253_PORT_CONTROL, (mode << 1) | (3 << 4));	/* Load first LSB then MSB, counter 0 */
+	port_write_byte(TIMER_8253_PORT_COUNTER0, value & 0xFF);
+	port_write_byte(TIMER_8253_PORT_COUNTER0, (value >> 8) & 0xFF);
+}
+
+static void timer_clock_periodic(void)
 {
-uint16_t value;
+	if (timer_apic)
+		apic_timer_periodic();
+	else
+		timer_program(TIMER_8253_MODE_PERIODIC, TIMER_8253_COUNT);
+}
+
+static void timer_clock_oneshot(unsigned int ticks)
+{
+	if (timer_apic)
+		apic_timer_oneshot(ticks);
+	else
+		timer_program(TIMER_8253_MODE_ONESHOT, ticks * TIMER_8253_COUNT);
+}
+
+/* Whole ticks gone by since the one-shot of ticks was started */
+static unsigned int timer_clock_elapsed(unsigned int ticks)
+{
+uint8_t low, high;
+
+	if (timer_apic)
+		return apic_timer_elapsed();
+
+	port_write_byte(TIMER_8253_PORT_CONTROL, 0);		/* Latch counter 0 */
+	port_read_byte(TIMER_8253_PORT_COUNTER0, &low);
+	port_read_byte(TIMER_8253_PORT_COUNTER0, &high);
 
+	// Past the terminal count the counter wraps around
+	if ((high << 8 | low) > ticks * TIMER_8253_COUNT)
+		return ticks;
+
+	return (ticks * TIMER_8253_COUNT - ((high << 8) | low)) / TIMER_8253_COUNT;
+}
+
+/****************
+ * Dynamic tick *
+ ****************/
+
+/* Let the idle thread stop the periodic tick. It can be changed at runtime */
+unsigned int timer_dynamic_tick = 1;
+
+static unsigned int timer_oneshot;	/* Ticks the running one-shot stands for, 0 when periodic */
+
+/* Whether running tick, where level 0 wraps around, brings no timers down */
+static int timer_cascade_empty(unsigned int tick)
+{
+unsigned int level, slot;
+
+	for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		slot = (tick >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+		if (timer_wheel[level][slot])
+			return 0;
+		if (slot)
+			break;
+	}
+
+	return 1;
+}
+
+/*
+ * Ticks from now to the first one with work, up to max: a timer expiring, or
+ * level 0 wrapping around and bringing timers down from the levels above.
+ * Level 0 only holds the next TIMER_WHEEL_SLOTS ticks, so after them only
+ * the wraps are looked at.
+ */
+static unsigned int timer_next(unsigned int max)
+{
+unsigned int ticks, tick;
+
+	for (ticks = 0; ticks < max; ticks++) {
+		tick = timer_ticks + ticks;
+
+		if (!(tick & (TIMER_WHEEL_SLOTS - 1)) && !timer_cascade_empty(tick))
+			return ticks + 1;
+
+		if (ticks < TIMER_WHEEL_SLOTS) {
+			if (timer_wheel[0][tick & (TIMER_WHEEL_SLOTS - 1)])
+				return ticks + 1;
+		} else
+			ticks += (TIMER_WHEEL_SLOTS - 1) - (tick & (TIMER_WHEEL_SLOTS - 1));
+	}
+
+	return max;
+}
+
+/*
+ * Count a tick and run the expired timers. Called by the timer interrupt
+ * (x86.asm - _irq0_handler, _apic_timer_handler). The other processors only
+ * use their tick to schedule.
+ */
+void timer_tick(void)
+{
+	if (cpu_current()) {
+		apic_timer_tick();
+		return;
+	}
+
+	if (timer_oneshot) {
+		// The one-shot is over: all the ticks it stood for have gone by
+		_ticks += timer_oneshot;
+		timer_oneshot = 0;
+		timer_clock_periodic();
+	} else {
+		_ticks++;
+		if (timer_apic)
+			apic_timer_tick();
+	}
+
+	timer_run();
+}
+
+/*
+ * Halt until the next interrupt. When only the idle thread can run, the
+ * periodic tick is stopped and the timer is programmed once for the first
+ * tick with work, so an idle system does not wake up TIMER_GRANULARITY_HZ
+ * times a second. Called by the idle thread.
+ */
+void timer_idle(void)
+{
+unsigned int ticks, elapsed;
+
+	interrupt_disable();
+
+	// The other processors have no timers to wait for, just their own tick
+	if (cpu_current()) {
+		if (!timer_dynamic_tick || process_schedule_ready()) {
+			cpu_halt();
+			return;
+		}
+
+		apic_timer_stop();
+		cpu_halt();
+		interrupt_disable();
+		apic_timer_periodic();
+		interrupt_enable();
+
+		return;
+	}
+
+	ticks = timer_next(min(timer_oneshot_max, TIMER_IDLE_MAX));
+	if (!timer_dynamic_tick || process_schedule_ready() || (ticks < 2)) {
+		cpu_halt();
+		return;
+	}
+
+	timer_oneshot = ticks;
+	timer_clock_oneshot(ticks);
+
+	// Interrupts are enabled and the processor halted at once, so the wakeup cannot be missed
+	cpu_halt();
+	interrupt_disable();
+
+	// Woken up by another interrupt: count the ticks gone by and go back to the periodic tick
+	if (timer_oneshot) {
+		elapsed = timer_clock_elapsed(timer_oneshot);
+
+		// If the one-shot is over its interrupt is pending, and counts the last tick
+		if (elapsed >= timer_oneshot)
+			elapsed = timer_oneshot - 1;
+
+		timer_oneshot = 0;
+		timer_clock_periodic();
+
+		_ticks += elapsed;
+		timer_run();
+	}
+
+	interrupt_enable();
+}
+
+err_t timer_init(void)
+{
 	// Initialize system ticks
 	_ticks = 0;
+	timer_ticks = 0;
 
 	/*
-	 * Initialize the Programmable Interval Timer (8253/8254)
+	 * Use the local APIC timer for the scheduler, or else the first
+	 * counter of the Programmable Interval Timer (8253/8254)
 	 */
 
-	/* Use the first counter for the scheduler */
-	value = 1193181 / TIMER_GRANULARITY_HZ;	
-
-	port_write_byte(TIMER_8253_PORT_CONTROL, (3 << 1) | (3 << 4));	/* Square wave generator, load first LSB then MSB, counter 0 */
-	port_write_byte(TIMER_8253_PORT_COUNTER0, value & 0xFF);
-	port_write_byte(TIMER_8253_PORT_COUNTER0, (value >> 8) & 0xFF);
+	if (timer_apic_enable && !apic_init() && !apic_timer_init()) {
+		timer_apic = 1;
+		timer_oneshot_max = apic_timer_max;
+		interrupt_irq_disable(0);
+	} else {
+		timer_oneshot_max = TIMER_ONESHOT_MAX;
+		timer_program(TIMER_8253_MODE_PERIODIC, TIMER_8253_COUNT);
+	}
 
 	return 0;
 }
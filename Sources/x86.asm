@@ -81,6 +81,22 @@ _gdt:
 	db	0
 	db	0
 	db	0
+
+; 0x40 - processor index, in the limit. 0 is the boot processor, see cpu_current
+	dw	0
+	dw	0
+	db	0
+	db	0x92
+	db	0
+	db	0
+
+; 0x48 - page fault TSS. Set in interrupt.c
+	dw	0
+	dw	0
+	db	0
+	db	0
+	db	0
+	db	0
 _gdt_end:
 
 _gdt_info:
@@ -88,21 +104,13 @@ _gdt_info:
 	dd	_gdt
 
 
-; *********
-; * TSSes *
-; *********
-
-SECTION .bss
-
-COMMON _double_fault_tss 104
-COMMON _kernel_tss	 104
-
 
 ; *******
 ; * CPU *
 ; *******
 
-GLOBAL cpu_cpuid_supported, cpu_cpuid_call, cpu_rdtsc, cpu_usermode
+GLOBAL cpu_cpuid_supported, cpu_cpuid_call, cpu_rdtsc, cpu_msr_read, cpu_msr_write, cpu_usermode
+GLOBAL cpu_current, cpu_lgdt
 
 SECTION .init
 
@@ -155,9 +163,46 @@ cpu_cpuid_call:
 cpu_rdtsc:
 	rdtsc
 	ret
+
+; The 64-bit value is returned in EDX:EAX
+cpu_msr_read:
+	mov	ecx, [esp + 4]
+	rdmsr
+	ret
+
+cpu_msr_write:
+	mov	ecx, [esp + 4]
+	mov	eax, [esp + 8]
+	mov	edx, [esp + 12]
+	wrmsr
+	ret
+
+; Index of the running processor, which is the limit of a descriptor of its own GDT
+cpu_current:
+	mov	eax, 0x40
+	lsl	eax, eax
+	ret
+
+; Load a GDT laid out as the boot one, and reload the segment registers from it
+cpu_lgdt:
+	mov	eax, [esp + 4]
+	lgdt	[eax]
+
+	mov	ax, 0x10
+	mov	ds, ax
+	mov	es, ax
+	mov	fs, ax
+	mov	gs, ax
+	mov	ss, ax
+
+	jmp	0x08:.1
+.1:
+	ret
 	
 cpu_usermode:
 	cli
+	call	interrupt_unlock
+
 	; Go to ring3 from ring0
 	;add	esp, 4		; The first argument is the EIP
 	push	0x20 + 3	; User SS
@@ -183,14 +228,14 @@ cpu_usermode:
 
 SECTION .init
 
-GLOBAL cpu_paging_enable
+GLOBAL cpu_paging_enable, cpu_pse_enable, cpu_pge_enable
 
 cpu_paging_enable:
 	mov	eax, [esp + 4]
 	mov	cr3, eax
 
 	mov	eax, cr0
-	or	eax, 0x80000000		; Enable paging flag
+	or	eax, 0x80010000		; Enable paging and write protection, so the kernel faults on copy on write pages too
 	mov	cr0, eax
 
 	jmp	.1
@@ -198,9 +243,23 @@ cpu_paging_enable:
 .1:
 	ret
 
+cpu_pse_enable:
+	mov	eax, cr4
+	or	eax, 0x10		; Page size extensions (4MB pages)
+	mov	cr4, eax
+
+	ret
+
+cpu_pge_enable:
+	mov	eax, cr4
+	or	eax, 0x80		; Global pages
+	mov	cr4, eax
+
+	ret
+
 SECTION .text
 
-GLOBAL cpu_mmu_invalidate, cpu_mmu_switch
+GLOBAL cpu_mmu_invalidate, _cpu_mmu_switch, cpu_mmu_flush, cpu_mmu_flush_global, cpu_mmu_fault_address
 
 cpu_mmu_invalidate:
 	mov	eax, [esp + 4]
@@ -215,14 +274,49 @@ cpu_mmu_invalidate:
 
 	ret
 
-cpu_mmu_switch:
+; Load CR3, storing it first in the kernel TSS and in the page fault TSS of the
+; processor, as cpu_mmu_switch asks. Nothing is pushed on the stack meanwhile,
+; since it may fault
+_cpu_mmu_switch:
 	mov	eax, [esp + 4]
+	mov	edx, [esp + 8]
+	mov	ecx, [esp + 12]
+
+	mov	[edx + 0x1C], eax
+	mov	[ecx + 0x1C], eax
 	mov	cr3, eax
 
 	jmp	.1
 .1:
 	ret
 
+; Flush the whole TLB but the global pages
+cpu_mmu_flush:
+	mov	eax, cr3
+	mov	cr3, eax
+
+	ret
+
+; Flush the global pages too, by turning them off and on again
+cpu_mmu_flush_global:
+	pushfd
+	cli
+
+	mov	eax, cr4
+	and	eax, ~0x80
+	mov	cr4, eax
+	or	eax, 0x80
+	mov	cr4, eax
+
+	popfd
+	ret
+
+; Address of the last page fault (CR2)
+cpu_mmu_fault_address:
+	mov	eax, cr2
+
+	ret
+
 ; **************
 ; * Interrupts *
 ; **************
@@ -245,10 +339,24 @@ interrupt_lidt:
 SECTION .text
 
 ; From interrupt.c
-EXTERN interrupt_trap_exception, interrupt_trap_irq, process_schedule
-
-; From timer.h
-EXTERN _ticks
+EXTERN interrupt_trap_exception, interrupt_trap_irq, interrupt_lock, interrupt_unlock
+
+; From Process/schedule.c
+EXTERN process_schedule, process_current_thread
+
+; From timer.c
+EXTERN timer_tick
+
+; Handlers run with interrupts disabled, so they take the interrupt lock
+; (see interrupt.c) after saving the registers. Before returning they give it
+; back if the iret enables interrupts again: the parameter is where the flags
+; of the interrupt frame are on the stack.
+%macro INTERRUPT_UNLOCK		1
+	test	dword [esp + %1], 0x200
+	jz	%%keep
+	call	interrupt_unlock
+%%keep:
+%endmacro
 
 %macro INT_HANDLER		1
 GLOBAL _int%1_handler
@@ -262,6 +370,8 @@ _int%1_handler:
 	push	ds
 	pusha
 
+	call	interrupt_lock
+
 	push	dword [esp + 48]	; EIP
 	push	dword [esp + 56]	; selector
 	push	dword 0			; address
@@ -272,6 +382,8 @@ _int%1_handler:
 	
 	add	esp, 4 * 5
 
+	INTERRUPT_UNLOCK	56
+
 	popa
 	pop	ds
 	pop	es
@@ -293,6 +405,8 @@ _int%1_handler:
 	push	ds
 	pusha
 
+	call	interrupt_lock
+
 	push	dword [esp + 52]	; EIP
 	push	dword [esp + 60]	; selector
 	push	dword 0			; address
@@ -303,6 +417,8 @@ _int%1_handler:
 	
 	add	esp, 4 * 5
 
+	INTERRUPT_UNLOCK	60
+
 	popa
 	pop	ds
 	pop	es
@@ -313,6 +429,8 @@ _int%1_handler:
 	iret
 %endmacro
 
+; Page faults come here only at boot, until the page fault task of the
+; processor is set up (see interrupt_init_tasks)
 %macro INT_HANDLER_PAGE		1
 GLOBAL _int%1_handler
 
@@ -325,10 +443,13 @@ _int%1_handler:
 	push	ds
 	pusha
 
+	; Another page fault may come while waiting for the lock. EBX survives the call
+	mov	ebx, cr2
+	call	interrupt_lock
+
 	push	dword [esp + 52]	; EIP
 	push	dword [esp + 60]	; selector
-	mov	eax, cr2
-	push	eax			; address
+	push	ebx			; address
 	push	dword [esp + 60]	; error code
 	push	dword %1		; interrupt number
 	
@@ -336,6 +457,8 @@ _int%1_handler:
 	
 	add	esp, 4 * 5
 
+	INTERRUPT_UNLOCK	60
+
 	popa
 	pop	ds
 	pop	es
@@ -358,6 +481,8 @@ _irq%1_handler:
 	mov	ds, ax
 	mov	es, ax
 
+	call	interrupt_lock
+
 	push	dword	%1
 	call	interrupt_trap_irq
 	add	esp, 4
@@ -367,6 +492,8 @@ _irq%1_handler:
 	out	0x20, al
 	out	0xA0, al
 
+	INTERRUPT_UNLOCK	40
+
 	popa
 
 	iret
@@ -406,14 +533,15 @@ IRQ_HANDLER		14
 IRQ_HANDLER		15
 
 GLOBAL _irq0_handler, process_thread_reschedule
-EXTERN current_thread
 _irq0_handler:
 	cld
 
 	pusha
 
-	; Increment ticks
-	inc	dword [_ticks]
+	call	interrupt_lock
+
+	; Count the ticks and run the expired timers
+	call	timer_tick
 
 	call	process_schedule
 
@@ -421,17 +549,85 @@ _irq0_handler:
 	mov	[eax + 0], esp
 
 	; Load the new thread's stack
-	mov	edi, [current_thread]
-	mov	esp, [edi + 0]
+	call	process_current_thread
+	mov	esp, [eax + 0]
 
 	; EOI
 	mov	al, 0x20
 	out	0x20, al
 
+	INTERRUPT_UNLOCK	40
+
+	popa
+	iret
+
+
+; The local APIC timer, which takes the place of IRQ0 when present
+GLOBAL _apic_timer_handler, _apic_spurious_handler
+EXTERN apic_registers
+_apic_timer_handler:
+	cld
+
+	pusha
+
+	call	interrupt_lock
+
+	; Count the ticks and run the expired timers
+	call	timer_tick
+
+	call	process_schedule
+
+	; Save the old thread's stack in its ESP variable
+	mov	[eax + 0], esp
+
+	; Load the new thread's stack
+	call	process_current_thread
+	mov	esp, [eax + 0]
+
+	; EOI
+	mov	eax, [apic_registers]
+	mov	dword [eax + 0xB0], 0
+
+	INTERRUPT_UNLOCK	40
+
+	popa
+	iret
+
+; Spurious interrupts are not acknowledged
+_apic_spurious_handler:
+	iret
+
+
+; Interprocessor interrupts. They do not touch shared data, so they run without
+; the interrupt lock, and they are taken even by a processor waiting for it
+GLOBAL _smp_reschedule_handler, _smp_tlb_handler
+EXTERN smp_tlb_poll
+
+; Only wakes up a halted processor, whose idle thread then looks for work
+_smp_reschedule_handler:
+	push	eax
+
+	mov	eax, [apic_registers]
+	mov	dword [eax + 0xB0], 0
+
+	pop	eax
+	iret
+
+_smp_tlb_handler:
+	cld
+
+	pusha
+
+	call	smp_tlb_poll
+
+	mov	eax, [apic_registers]
+	mov	dword [eax + 0xB0], 0
+
 	popa
 	iret
 
 
+; Called with the interrupt lock held
 process_thread_reschedule:
 	; Simulate a timer interrupt
 	mov	eax, [esp]	; Store the EIP
@@ -448,8 +644,10 @@ process_thread_reschedule:
 	mov	[eax + 0], esp
 
 	; Load the new thread's stack
-	mov	edi, [current_thread]
-	mov	esp, [edi + 0]
+	call	process_current_thread
+	mov	esp, [eax + 0]
+
+	INTERRUPT_UNLOCK	40
 
 	popa
 	iret
@@ -472,6 +670,8 @@ _int_unhandled:
 	push	ds
 	pusha
 
+	call	interrupt_lock
+
 	push	dword [esp + 48]	; EIP
 	push	dword [esp + 56]	; selector
 	push	dword 0			; address
@@ -481,6 +681,8 @@ _int_unhandled:
 	call	interrupt_trap_exception
 	add	esp, 4 * 5
 
+	INTERRUPT_UNLOCK	56
+
 	popa
 	pop	ds
 	pop	es
@@ -490,21 +692,79 @@ _int_unhandled:
 	iret
 
 
+; Page fault task. The processor switches to it through a task gate, with the
+; error code on its stack, and the iret switches back to the faulting task, so
+; the next page fault starts just after it
+GLOBAL _page_fault_handler
+EXTERN interrupt_trap_page
+
+_page_fault_handler:
+	cld
+
+	call	interrupt_trap_page	; the error code is its parameter
+	add	esp, 4
+
+	iret
+	jmp	_page_fault_handler
+
+
+; Double fault task. The processor switches to it through a task gate, and the
+; faulting task cannot be resumed, so it never returns
+GLOBAL _double_fault_handler
+EXTERN interrupt_trap_doublefault
+
+_double_fault_handler:
+	cld
+
+	add	esp, 4		; skip error code, which is always 0
+
+	call	interrupt_trap_doublefault
+
+	cli
+	hlt
+	jmp	_double_fault_handler
+
+
 GLOBAL interrupt_enable, interrupt_disable
 
+; With interrupts the processor takes and leaves the interrupt lock too
 interrupt_enable:
+	call	interrupt_unlock
 	sti
 	ret
 
 interrupt_disable:
 	cli
-	ret
+	jmp	interrupt_lock
 
 GLOBAL cpu_flags_get
 cpu_flags_get:
 	pushf
 	pop	eax
 	ret
+
+; Disable interrupts on this processor only, without the interrupt lock, and
+; return the flags they had. For sections touching only data of this
+; processor, which must not call interrupt_disable before cpu_interrupt_restore
+GLOBAL cpu_interrupt_save, cpu_interrupt_restore
+cpu_interrupt_save:
+	pushfd
+	pop	eax
+	cli
+	ret
+
+cpu_interrupt_restore:
+	push	dword [esp + 4]
+	popfd
+	ret
+
+; Wait for the next interrupt
+GLOBAL cpu_halt
+cpu_halt:
+	call	interrupt_unlock
+	sti
+	hlt
+	ret
 	
 GLOBAL _syscall_misc_trap
 EXTERN syscall_misc
@@ -554,6 +814,101 @@ process_ltr:
 .1:
 	ret
 
+GLOBAL process_current_thread, process_current_process
+EXTERN process_cpu_thread, process_cpu_process
+
+; Running thread and process of this processor. Interrupts are disabled in
+; between, so the caller cannot be moved to another processor halfway
+process_current_thread:
+	pushfd
+	cli
+
+	mov	eax, 0x40
+	lsl	eax, eax
+	mov	eax, [process_cpu_thread + eax * 4]
+
+	popfd
+	ret
+
+process_current_process:
+	pushfd
+	cli
+
+	mov	eax, 0x40
+	lsl	eax, eax
+	mov	eax, [process_cpu_process + eax * 4]
+
+	popfd
+	ret
+
+
+; **************************
+; * Multiprocessor startup *
+; **************************
+
+; The trampoline is copied by smp.c to a page below 1MB, where a starting
+; processor runs it in real mode. It loads the GDT of the processor, enters
+; protected mode and jumps into the kernel, which enables paging as the boot
+; processor did and calls smp_start on the stack smp.c set up.
+
+SECTION .text
+
+GLOBAL _smp_trampoline, _smp_trampoline_gdt, _smp_trampoline_end
+EXTERN smp_boot_cr3, smp_boot_cr4, smp_boot_stack, smp_start
+
+BITS 16
+
+_smp_trampoline:
+	cli
+	cld
+
+	mov	ax, cs
+	mov	ds, ax
+
+	o32 lgdt [_smp_trampoline_gdt - _smp_trampoline]
+
+	mov	eax, cr0
+	or	eax, 1			; Protected mode
+	mov	cr0, eax
+
+	jmp	dword 0x08:smp_trampoline_32
+
+ALIGN 4
+; GDT of the starting processor, a struct gdt_info filled by smp.c
+_smp_trampoline_gdt:
+	dw	0
+	dd	0
+_smp_trampoline_end:
+
+BITS 32
+
+smp_trampoline_32:
+	mov	ax, 0x10
+	mov	ds, ax
+	mov	es, ax
+	mov	fs, ax
+	mov	gs, ax
+	mov	ss, ax
+
+	mov	eax, [smp_boot_cr4]
+	mov	cr4, eax
+	mov	eax, [smp_boot_cr3]
+	mov	cr3, eax
+
+	mov	eax, cr0
+	or	eax, 0x80010000		; Paging and write protection, as in cpu_paging_enable
+	mov	cr0, eax
+
+	jmp	.1
+.1:
+	mov	esp, [smp_boot_stack]
+	call	smp_start
+
+	; smp_start never returns
+.freeze:
+	hlt
+	jmp	.freeze
+
 
 ; **************************************************
 ; * Uninitialized page-aligned data and structures *
@@ -563,17 +918,13 @@ process_ltr:
 
 section .page_aligned nobits alloc noexec write align=4096
 
-GLOBAL _initial_stack, _process_page_directory, _dummy_page_directory
+GLOBAL _initial_stack, _process_page_directory
 
 
 	resd	4096
 _initial_stack:
 
-; Those pages will be immediately freed and put on the physical page stack.
-; It is only a placeholder where we will map the process page directories we are going to modify
+; The kernel page directory. Kernel page tables are created here and copied to the other
+; page directories when they need them
 _process_page_directory:
 	resd	1024
-	
-; It is only a placeholder where we will map the page directories we are going to modify
-_dummy_page_directory:
-	resd	1024